@@ -22,15 +22,24 @@
 #include "anu/audio_buffer.h"
 #include "anu/clock.h"
 #include "anu/dco_controller.h"
+#include "anu/eeprom_writer.h"
 #include "anu/hardware_config.h"
 #include "anu/midi_dispatcher.h"
+#include "anu/midi_out_queue.h"
 #include "anu/parameter.h"
+#include "anu/performance_counters.h"
+#include "anu/program_storage.h"
+#include "anu/sysex_handler.h"
 #include "anu/ui.h"
 #include "anu/voice_controller.h"
 #include "anu/voice_tuner.h"
 
 #include "midi/midi.h"
 
+#ifdef ANU_BENCHMARK
+#include "anu/benchmark/benchmark.h"
+#endif  // ANU_BENCHMARK
+
 using namespace avrlib;
 using namespace anu;
 using namespace midi;
@@ -44,7 +53,7 @@ PitchCalibrationInput pitch_calibration_input;
 DcoOut dco_out;
 
 MidiIO midi_io;
-MidiBuffer midi_in_buffer;
+MidiInBuffer midi_in_buffer;
 MidiStreamParser<MidiDispatcher> midi_parser;
 
 Timer<0> dac_timer;
@@ -58,61 +67,80 @@ volatile uint16_t clock_ticks = 0;
 volatile uint8_t num_external_clock_events = 0;
 
 inline void FlushMidiOut() {
-  // Try to flush the high priority buffer first.
-  if (midi_dispatcher.readable_high_priority()) {
-    if (midi_io.writable()) {
-      midi_io.Overwrite(midi_dispatcher.ImmediateReadHighPriority());
-    }
-  } else {
-    if (midi_dispatcher.readable_low_priority()) {
-      if (midi_io.writable()) {
-        midi_io.Overwrite(midi_dispatcher.ImmediateReadLowPriority());
-      }
-    }
+  uint8_t byte;
+  if (midi_io.writable() && midi_dispatcher.ReadOutput(&byte)) {
+    midi_io.Overwrite(byte);
   }
 }
 
-inline void PollMidiIn() {
-  if (midi_io.readable()) {
-    midi_in_buffer.NonBlockingWrite(midi_io.ImmediateRead());
+// The DACs are written through the SPI data register rather than with
+// dac.Send(), which waits for the end of each byte before returning. Here, the
+// next byte or word is prepared while the current byte is being shifted out,
+// and the SPI is only polled when the data register is needed again. The
+// transfer of the last word completes while the DCO is updated.
+static bool dac_transfer_pending = false;
+
+inline void WaitForDACTransfer() {
+  while (!(SPSR & _BV(SPIF)));
+}
+
+inline void EndDACTransfer() {
+  if (dac_transfer_pending) {
+    WaitForDACTransfer();
+    // Cheaper than remembering which of the two DACs is selected.
+    dac_1_ss.High();
+    dac_2_ss.High();
+    dac_transfer_pending = false;
   }
 }
 
+template<typename SlaveSelect>
+inline void WriteDACWord(uint16_t word) {
+  EndDACTransfer();
+  SlaveSelect::Low();
+  SPDR = word >> 8;
+  uint8_t lsb = word & 0xff;
+  WaitForDACTransfer();
+  SPDR = lsb;
+  dac_transfer_pending = true;
+}
+
 inline bool UpdateDACs() {
-  Word dac_value;
-  voice_controller.mutable_voice()->ReadDACStateSample();
+  Voice* voice = voice_controller.mutable_voice();
+  if (voice->readable()) {
+    voice->ReadDACStateSample();
+  } else {
+    // Hold the previous values rather than reading past the write pointer.
+    performance_counters.CountDACUnderrun();
+  }
   const DACState& dac_state = voice_controller.voice().dac_state();
   
+  // Only the channels which have changed are sent. Most of the time, only
+  // the modulated channels are refreshed.
+  uint8_t changes = voice->TakeDACStateChanges();
+  
   // Write VCO CV.
   // 0.5V / Oct.
   // 2.048V = Midi note 60 = 261.625
-  dac_value.value = 0x1000 | dac_state.vco_cv;
-  dac_1_ss.Low();
-  dac.Send(dac_value.bytes[1]);
-  dac.Send(dac_value.bytes[0]);
-  dac_1_ss.High();
+  if (changes & DAC_CHANNEL_VCO) {
+    WriteDACWord<DAC1SS>(0x1000 | dac_state.vco_cv);
+  }
   
   // Write VCF CV.
   // 0.5V / Oct.
-  dac_value.value = 0x9000 | dac_state.vcf_cv;
-  dac_1_ss.Low();
-  dac.Send(dac_value.bytes[1]);
-  dac.Send(dac_value.bytes[0]);
-  dac_1_ss.High();
+  if (changes & DAC_CHANNEL_VCF) {
+    WriteDACWord<DAC1SS>(0x9000 | dac_state.vcf_cv);
+  }
   
   // Write VCA CV.
-  dac_value.value = 0x1000 | dac_state.vca_cv;
-  dac_2_ss.Low();
-  dac.Send(dac_value.bytes[1]);
-  dac.Send(dac_value.bytes[0]);
-  dac_2_ss.High();
+  if (changes & DAC_CHANNEL_VCA) {
+    WriteDACWord<DAC2SS>(0x1000 | dac_state.vca_cv);
+  }
   
   // Write PWM CV.
-  dac_value.value = 0x9000 | dac_state.pw_cv;
-  dac_2_ss.Low();
-  dac.Send(dac_value.bytes[1]);
-  dac.Send(dac_value.bytes[0]);
-  dac_2_ss.High();
+  if (changes & DAC_CHANNEL_PW) {
+    WriteDACWord<DAC2SS>(0x9000 | dac_state.pw_cv);
+  }
   
   return dac_state.vca_cv != 0;
 }
@@ -120,7 +148,7 @@ inline bool UpdateDACs() {
 static uint8_t cycle = 0;
 static uint8_t previous_in = 0xff;
 
-// 4.9kHz: MIDI in/out; gate & clock poll.
+// 4.9kHz: MIDI out; gate & clock poll.
 // 2.45kHz: DAC & DCO refresh
 // 0.61kHz: UI poll
 ISR(TIMER0_OVF_vect, ISR_NOBLOCK) {
@@ -132,9 +160,10 @@ ISR(TIMER0_OVF_vect, ISR_NOBLOCK) {
       // drums channel.
       dco_controller.Mute();
     }
+    EndDACTransfer();
   }
-  PollMidiIn();
   FlushMidiOut();
+  performance_counters.Sample();
   
   // Read the input shift register without updating the switch debounce state.
   uint8_t in = inputs.ReadRegister();
@@ -191,6 +220,24 @@ ISR(TIMER1_OVF_vect, ISR_NOBLOCK) {
   ++num_overflows;
 }
 
+// The incoming MIDI bytes are timestamped on reception, so that the events
+// they form are played at a constant latency, whatever the time it takes for
+// the main loop to parse them.
+ISR(USART_RX_vect) {
+  TimestampedMidiByte byte;
+  byte.value = midi_io.ImmediateRead();
+  byte.timestamp.audio = audio_buffer.read_position();
+  byte.timestamp.dac = voice_controller.voice().dac_timestamp();
+  if (!midi_in_buffer.NonBlockingWrite(byte)) {
+    performance_counters.CountMidiInOverrun();
+  }
+}
+
+// Enabled while the EEPROM writer has some data to save.
+ISR(EE_READY_vect) {
+  eeprom_writer.WriteNextByte();
+}
+
 // 39kHz clock used for the tempo counter.
 ISR(TIMER2_OVF_vect, ISR_NOBLOCK) {
   clock.Tick();
@@ -203,6 +250,11 @@ inline void Init() {
   ResetWatchdog();
   
   midi_io.Init();
+  midi_out_queue.Init();
+  eeprom_writer.Init();
+  program_storage.Init();
+  performance_counters.Init();
+  audio_buffer.Init();
   system_settings.Init();
   drum_synth.Init();
   voice_controller.Init();
@@ -233,12 +285,26 @@ inline void Init() {
   audio_out.Init();
   
   dco_controller.Start();
+  
+  // Start receiving MIDI bytes, now that the modules which timestamp them are
+  // initialized.
+  UCSR0B |= _BV(RXCIE0);
 }
 
 int main(void) {
   Init();
+#ifdef ANU_BENCHMARK
+  Benchmark::Run();
+#endif  // ANU_BENCHMARK
   ui.FlushEvents();
   while (1) {
+    // The main loop is idle when it has nothing to render or parse. The
+    // fraction of time spent busy is measured by the DAC interrupt.
+    performance_counters.set_main_loop_busy(
+        voice_controller.voice().writable() ||
+        audio_buffer.writable() ||
+        midi_in_buffer.readable());
+    
     // Fill some samples for the DACs.
     voice_controller.mutable_voice()->Refresh();
     
@@ -280,9 +346,17 @@ int main(void) {
     // Check if there is some MIDI data to process. If so, decode the MIDI
     // bytestream.
     while (midi_in_buffer.readable()) {
-      midi_parser.PushByte(midi_in_buffer.ImmediateRead());
+      TimestampedMidiByte byte = midi_in_buffer.ImmediateRead();
+      midi_dispatcher.set_timestamp(byte.timestamp);
+      midi_parser.PushByte(byte.value);
     }
     
+    // Recall the program requested by a Program Change received while the
+    // EEPROM was being written, and save the sequence which did not fit in
+    // the EEPROM writer queue.
+    voice_controller.RecallPendingProgram();
+    voice_controller.SavePendingSequence();
+    
     // Update the voice tuner state machine.
     voice_tuner.Refresh();
     if (num_overflows > 32) {
@@ -291,5 +365,8 @@ int main(void) {
     
     // Handle UI events
     ui.DoEvents();
+    
+    // Stream the requested SysEx blocks.
+    sysex_handler.Refresh();
   }
 }
@@ -22,6 +22,6 @@
 namespace anu {
 
 /* extern */
-avrlib::RingBuffer<AudioBufferSpecs> audio_buffer;
+AudioBuffer<ActiveBufferPolicy> audio_buffer;
 
 }  // namespace anu
@@ -15,26 +15,126 @@
 //
 // -----------------------------------------------------------------------------
 //
-// Instance of the audio buffer class.
+// Audio buffer between the drum synth and the audio interrupt.
+//
+// Two blocks of samples are swapped: the interrupt reads one of them with a
+// post-incremented pointer while the other one is rendered, and moves to the
+// other block at the block boundary if it is ready. If it is not, the last
+// sample is held. The size of the blocks is given by the buffer policy.
 
 #ifndef ANU_AUDIO_BUFFER_H_
 #define ANU_AUDIO_BUFFER_H_
 
-#include "avrlib/ring_buffer.h"
+#include "avrlib/base.h"
+
+#include <string.h>
+
+#include "anu/buffer_policy.h"
+#include "anu/performance_counters.h"
 
 namespace anu {
 
-struct AudioBufferSpecs {
-  typedef uint8_t Value;
+static const uint8_t kNumAudioBlocks = 2;
+
+template<typename Policy>
+class AudioBuffer {
+ public:
   enum {
-    buffer_size = 128,
-    data_size = 8,
+    block_size = Policy::audio_block_size
   };
+
+  AudioBuffer() { }
+  
+  static void Init() {
+    // The interrupt starts by playing the first block, which is filled with
+    // silence.
+    memset(buffer_, 0, sizeof(buffer_));
+    read_ptr_ = buffer_;
+    num_written_blocks_ = 1;
+    num_read_blocks_ = 0;
+  }
+  
+  // Number of blocks that can be rendered.
+  static inline uint8_t writable() {
+    return kNumAudioBlocks - static_cast<uint8_t>(
+        num_written_blocks_ - num_read_blocks_);
+  }
+  
+  // The block to render into, valid when writable() is non-zero. It must be
+  // filled with block_size samples and handed to the interrupt with
+  // Commit().
+  static inline uint8_t* write_block() {
+    return buffer_ + (num_written_blocks_ & 1) * block_size;
+  }
+  
+  static inline void Commit() {
+    ++num_written_blocks_;
+  }
+  
+  // Positions in the stream of samples, modulo 256: that of the sample to be
+  // played next by the interrupt, and that of the first sample of the block
+  // returned by write_block(). Used to timestamp the incoming MIDI events.
+  static inline uint8_t read_position() {
+    return num_read_blocks_ * block_size + (static_cast<uint8_t>(
+        reinterpret_cast<uintptr_t>(read_ptr_)) & (block_size - 1));
+  }
+  
+  static inline uint8_t write_position() {
+    return num_written_blocks_ * block_size;
+  }
+  
+  // Called by the audio interrupt.
+  static inline uint8_t ImmediateRead() {
+    uint8_t value = *read_ptr_++;
+    if (!(static_cast<uint8_t>(reinterpret_cast<uintptr_t>(read_ptr_)) &
+          (block_size - 1))) {
+      NextBlock();
+    }
+    return value;
+  }
+  
+ private:
+  static inline void NextBlock() {
+    if (static_cast<uint8_t>(num_written_blocks_ - num_read_blocks_) >= 2) {
+      ++num_read_blocks_;
+      read_ptr_ = buffer_ + (num_read_blocks_ & 1) * block_size;
+    } else {
+      // The next block is not ready: stay on the last sample.
+      --read_ptr_;
+      performance_counters.CountAudioUnderrun();
+    }
+  }
+   
+  // Aligned so that the block boundaries can be detected from the lower bits
+  // of the read pointer.
+  static uint8_t buffer_[kNumAudioBlocks * block_size]
+      __attribute__((aligned(kNumAudioBlocks * block_size)));
+  static uint8_t* read_ptr_;
+  static volatile uint8_t num_written_blocks_;
+  static volatile uint8_t num_read_blocks_;
+  
+  DISALLOW_COPY_AND_ASSIGN(AudioBuffer);
 };
 
-static const uint8_t kAudioBlockSize = 32;
+/* static */
+template<typename Policy>
+uint8_t AudioBuffer<Policy>::buffer_[kNumAudioBlocks * block_size];
+
+/* static */
+template<typename Policy>
+uint8_t* AudioBuffer<Policy>::read_ptr_ = AudioBuffer<Policy>::buffer_;
+
+/* static */
+template<typename Policy>
+volatile uint8_t AudioBuffer<Policy>::num_written_blocks_ = 1;
+
+/* static */
+template<typename Policy>
+volatile uint8_t AudioBuffer<Policy>::num_read_blocks_ = 0;
+
+static const uint8_t kAudioBlockSize = ActiveBufferPolicy::audio_block_size;
 
-extern avrlib::RingBuffer<AudioBufferSpecs> audio_buffer;
+extern AudioBuffer<ActiveBufferPolicy> audio_buffer;
 
 }  // namespace anu
 
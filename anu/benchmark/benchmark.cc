@@ -0,0 +1,439 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Cycle-count benchmark of the firmware hot paths.
+
+#include "anu/benchmark/benchmark.h"
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "anu/audio_buffer.h"
+#include "anu/drum_synth.h"
+#include "anu/eeprom_writer.h"
+#include "anu/envelope.h"
+#include "anu/hardware_config.h"
+#include "anu/lfo.h"
+#include "anu/note_stack.h"
+#include "anu/program_storage.h"
+#include "anu/system_settings.h"
+#include "anu/voice_controller.h"
+
+// The interrupt handlers defined in anu.cc. They end with a reti and can thus
+// be called like regular functions - with the side effect of re-enabling
+// interrupts.
+extern "C" void TIMER0_OVF_vect(void);
+extern "C" void TIMER2_OVF_vect(void);
+
+namespace anu {
+
+using namespace avrlib;
+
+static MidiIO serial;
+
+static uint16_t overhead;
+
+// Timer 1 counts CPU cycles. The compiler barriers prevent the measured code
+// from being moved across the reads of the counter.
+static inline uint16_t cycles() {
+  asm volatile("" ::: "memory");
+  uint16_t value = TCNT1;
+  asm volatile("" ::: "memory");
+  return value;
+}
+
+#define MEASURE(measurement, statement) \
+  { \
+    uint16_t start = cycles(); \
+    statement; \
+    measurement.Add(cycles() - start - overhead); \
+  }
+
+static const prog_char str_empty[] PROGMEM = "";
+static const prog_char str_eol[] PROGMEM = "\r\n";
+static const prog_char str_comma[] PROGMEM = ",";
+static const prog_char str_begin[] PROGMEM = "BEGIN\r\n";
+static const prog_char str_end[] PROGMEM = "END\r\n";
+static const prog_char str_header[] PROGMEM = \
+    "name,variant,calls,min,max,mean\r\n";
+
+static const prog_char str_drum_synth_render[] PROGMEM = "DrumSynth::Render";
+static const prog_char str_drum_synth_update_modulations[] PROGMEM = \
+    "DrumSynth::UpdateModulations";
+static const prog_char str_voice_write_dac_state_sample[] PROGMEM = \
+    "Voice::WriteDACStateSample";
+static const prog_char str_envelope_render[] PROGMEM = "Envelope::Render";
+static const prog_char str_lfo_render[] PROGMEM = "Lfo::Render";
+static const prog_char str_note_stack_note_on[] PROGMEM = \
+    "NoteStack::NoteOn";
+static const prog_char str_note_stack_note_off[] PROGMEM = \
+    "NoteStack::NoteOff";
+static const prog_char str_system_settings_init[] PROGMEM = \
+    "SystemSettings::Init";
+static const prog_char str_voice_controller_recall_program[] PROGMEM = \
+    "VoiceController::RecallProgram";
+static const prog_char str_timer0_ovf_vect[] PROGMEM = "TIMER0_OVF_vect";
+static const prog_char str_timer2_ovf_vect[] PROGMEM = "TIMER2_OVF_vect";
+static const prog_char str_latency_us[] PROGMEM = "Latency (us)";
+
+static const prog_char str_idle[] PROGMEM = "idle";
+static const prog_char str_bd[] PROGMEM = "bd";
+static const prog_char str_bd_sd_hh[] PROGMEM = "bd_sd_hh";
+static const prog_char str_bd_sd_hh_crunchy[] PROGMEM = "bd_sd_hh_crunchy";
+static const prog_char str_rest[] PROGMEM = "rest";
+static const prog_char str_note_on[] PROGMEM = "note_on";
+static const prog_char str_attack[] PROGMEM = "attack";
+static const prog_char str_sustain[] PROGMEM = "sustain";
+static const prog_char str_drum_trigger[] PROGMEM = "drum_trigger";
+static const prog_char str_cv_note_on[] PROGMEM = "cv_note_on";
+static const prog_char str_glissando[] PROGMEM = "glissando";
+static const prog_char str_full[] PROGMEM = "full";
+static const prog_char str_journal_scan[] PROGMEM = "journal_scan";
+static const prog_char str_full_sequence[] PROGMEM = "full_sequence";
+
+static const prog_char str_triangle[] PROGMEM = "triangle";
+static const prog_char str_square[] PROGMEM = "square";
+static const prog_char str_ramp_up[] PROGMEM = "ramp_up";
+static const prog_char str_ramp_down[] PROGMEM = "ramp_down";
+static const prog_char str_s_h[] PROGMEM = "s_h";
+static const prog_char str_bernouilli[] PROGMEM = "bernouilli";
+static const prog_char str_lines[] PROGMEM = "lines";
+static const prog_char str_noise[] PROGMEM = "noise";
+
+static const prog_char* lfo_shape_names[LFO_SHAPE_LAST] = {
+  str_triangle,
+  str_square,
+  str_ramp_up,
+  str_ramp_down,
+  str_s_h,
+  str_bernouilli,
+  str_lines,
+  str_noise
+};
+
+static const uint8_t kNumCalls = 64;
+static const uint8_t kNumBlocks = 16;
+
+/* static */
+void Benchmark::Print(const prog_char* s) {
+  uint8_t c;
+  while ((c = pgm_read_byte(s++))) {
+    serial.Write(c);
+  }
+}
+
+/* static */
+void Benchmark::Print(uint32_t value) {
+  char digits[10];
+  uint8_t num_digits = 0;
+  do {
+    digits[num_digits++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (num_digits) {
+    serial.Write(digits[--num_digits]);
+  }
+}
+
+/* static */
+void Benchmark::Report(
+    const prog_char* name,
+    const prog_char* variant,
+    const Measurement& measurement) {
+  Print(name);
+  Print(str_comma);
+  Print(variant);
+  Print(str_comma);
+  Print(static_cast<uint32_t>(measurement.count));
+  Print(str_comma);
+  Print(static_cast<uint32_t>(measurement.min));
+  Print(str_comma);
+  Print(static_cast<uint32_t>(measurement.max));
+  Print(str_comma);
+  Print(measurement.total / measurement.count);
+  Print(str_eol);
+}
+
+// Leaves room for exactly one block in the audio buffer, so that each call to
+// DrumSynth::Render() renders a single block.
+static void PrimeAudioBuffer() {
+  audio_buffer.Init();
+}
+
+/* static */
+void Benchmark::BenchmarkDrumSynth() {
+  Measurement m;
+  
+  m.Init();
+  for (uint8_t i = 0; i < kNumBlocks; ++i) {
+    PrimeAudioBuffer();
+    MEASURE(m, drum_synth.Render());
+  }
+  Report(str_drum_synth_render, str_idle, m);
+
+  m.Init();
+  drum_synth.Trigger(0, 255);
+  for (uint8_t i = 0; i < kNumBlocks; ++i) {
+    PrimeAudioBuffer();
+    MEASURE(m, drum_synth.Render());
+  }
+  Report(str_drum_synth_render, str_bd, m);
+
+  m.Init();
+  for (uint8_t i = 0; i < kNumDrumInstruments; ++i) {
+    drum_synth.Trigger(i, 255);
+  }
+  for (uint8_t i = 0; i < kNumBlocks; ++i) {
+    PrimeAudioBuffer();
+    MEASURE(m, drum_synth.Render());
+  }
+  Report(str_drum_synth_render, str_bd_sd_hh, m);
+
+  m.Init();
+  drum_synth.SetBandwidth(64);
+  for (uint8_t i = 0; i < kNumDrumInstruments; ++i) {
+    drum_synth.Trigger(i, 255);
+  }
+  for (uint8_t i = 0; i < kNumBlocks; ++i) {
+    PrimeAudioBuffer();
+    MEASURE(m, drum_synth.Render());
+  }
+  drum_synth.SetBandwidth(255);
+  Report(str_drum_synth_render, str_bd_sd_hh_crunchy, m);
+
+  m.Init();
+  for (uint8_t i = 0; i < kNumDrumInstruments; ++i) {
+    drum_synth.Trigger(i, 255);
+  }
+  for (uint8_t i = 0; i < kNumBlocks; ++i) {
+    MEASURE(m, drum_synth.UpdateModulations());
+  }
+  Report(str_drum_synth_update_modulations, str_bd_sd_hh, m);
+}
+
+/* static */
+void Benchmark::BenchmarkVoice() {
+  Measurement m;
+  Voice* voice = voice_controller.mutable_voice();
+  
+  m.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, voice->WriteDACStateSample());
+  }
+  Report(str_voice_write_dac_state_sample, str_rest, m);
+
+  m.Init();
+  voice_controller.NoteOn(60, 100);
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, voice->WriteDACStateSample());
+  }
+  voice_controller.NoteOff(60);
+  Report(str_voice_write_dac_state_sample, str_note_on, m);
+}
+
+/* static */
+void Benchmark::BenchmarkEnvelope() {
+  Measurement m;
+  static Envelope envelope;
+  envelope.Init();
+  envelope.Update(40, 60, 128, 60);
+  
+  m.Init();
+  envelope.Trigger(ENV_SEGMENT_ATTACK);
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, envelope.Render());
+  }
+  Report(str_envelope_render, str_attack, m);
+
+  m.Init();
+  envelope.Trigger(ENV_SEGMENT_SUSTAIN);
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, envelope.Render());
+  }
+  Report(str_envelope_render, str_sustain, m);
+}
+
+/* static */
+void Benchmark::BenchmarkLfo() {
+  Measurement m;
+  static Lfo lfo;
+  
+  // A fast rate, so that the sample & hold shapes loop during the benchmark.
+  lfo.set_phase_increment(0x08000000);
+  for (uint8_t shape = 0; shape < LFO_SHAPE_LAST; ++shape) {
+    m.Init();
+    lfo.set_shape(static_cast<LfoShape>(shape));
+    for (uint8_t i = 0; i < kNumCalls; ++i) {
+      MEASURE(m, lfo.Render());
+    }
+    Report(str_lfo_render, lfo_shape_names[shape], m);
+  }
+}
+
+/* static */
+void Benchmark::BenchmarkNoteStack() {
+  Measurement on;
+  Measurement off;
+  static NoteStack<16> stack;
+  stack.Init();
+  
+  // Each key is released after the next one is pressed.
+  on.Init();
+  off.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(on, stack.NoteOn(36 + i, 100));
+    MEASURE(off, stack.NoteOff(35 + i));
+  }
+  Report(str_note_stack_note_on, str_glissando, on);
+  Report(str_note_stack_note_off, str_glissando, off);
+  
+  // Chords mashed on a saturated stack: each note on releases the least
+  // recent note, and each note off finds a note among 16.
+  on.Init();
+  off.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(on, stack.NoteOn(36 + (i * 7) % 48, 100));
+    MEASURE(off, stack.NoteOff(36 + (i * 11) % 48));
+    stack.NoteOn(36 + (i * 11) % 48, 100);
+  }
+  Report(str_note_stack_note_on, str_full, on);
+  Report(str_note_stack_note_off, str_full, off);
+}
+
+/* static */
+void Benchmark::BenchmarkStorage() {
+  Measurement m;
+  
+  // Boot-time scan of the journal of system settings.
+  m.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, system_settings.Init());
+  }
+  Report(str_system_settings_init, str_journal_scan, m);
+  
+  // Program Change, with a full sequence. The program is written
+  // synchronously since the interrupts are disabled. It is only stored, and
+  // recalled, once the writer is done with the previous requests.
+  while (EECR & _BV(EERIE)) {
+    eeprom_writer.WriteNextByte();
+  }
+  voice_controller.mutable_sequence()->size = kSequenceDataSize;
+  voice_controller.StoreProgram(0);
+  while (EECR & _BV(EERIE)) {
+    eeprom_writer.WriteNextByte();
+  }
+  m.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, voice_controller.RecallProgram(0));
+  }
+  Report(str_voice_controller_recall_program, str_full_sequence, m);
+}
+
+/* static */
+void Benchmark::BenchmarkInterrupts() {
+  Measurement m;
+  
+  // Timer 0 handler: 8 consecutive calls cover all its sub-rates.
+  m.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, TIMER0_OVF_vect());
+    cli();
+  }
+  Report(str_timer0_ovf_vect, str_empty, m);
+
+  m.Init();
+  for (uint8_t i = 0; i < kNumCalls; ++i) {
+    MEASURE(m, TIMER2_OVF_vect());
+    cli();
+  }
+  Report(str_timer2_ovf_vect, str_empty, m);
+}
+
+/* static */
+void Benchmark::ReportLatency(
+    const prog_char* variant,
+    uint16_t min_period,
+    uint16_t max_period) {
+  // The periods are in 1/10 of microseconds. They are computed rather than
+  // measured, so the calls and mean columns are left empty.
+  Print(str_latency_us);
+  Print(str_comma);
+  Print(variant);
+  Print(str_comma);
+  Print(str_comma);
+  Print(static_cast<uint32_t>(min_period / 10));
+  Print(str_comma);
+  Print(static_cast<uint32_t>(max_period / 10));
+  Print(str_comma);
+  Print(str_eol);
+}
+
+/* static */
+void Benchmark::BenchmarkLatency() {
+  // A drum trigger is scheduled kNumAudioBlocks blocks after the sample
+  // which was playing when it was received, whatever the position of this
+  // sample in its block.
+  ReportLatency(
+      str_drum_trigger,
+      kNumAudioBlocks * kAudioBlockSize * kAudioSamplePeriod,
+      kNumAudioBlocks * kAudioBlockSize * kAudioSamplePeriod);
+  
+  // Likewise, a note on is scheduled kDACStateBufferSize DAC states after the
+  // one which was playing when it was received.
+  ReportLatency(
+      str_cv_note_on,
+      kDACStateBufferSize * kDACSamplePeriod,
+      kDACStateBufferSize * kDACSamplePeriod);
+}
+
+/* static */
+void Benchmark::Run() {
+  // Stop all the interrupt sources enabled by Init(), and use Timer 1 as a
+  // cycle counter.
+  cli();
+  TIMSK0 = 0;
+  TIMSK1 = 0;
+  TIMSK2 = 0;
+  TCCR1A = 0;
+  TCCR1B = _BV(CS10);
+  
+  uint16_t start = cycles();
+  overhead = cycles() - start;
+  
+  Print(str_begin);
+  Print(str_header);
+  BenchmarkDrumSynth();
+  BenchmarkVoice();
+  BenchmarkEnvelope();
+  BenchmarkLfo();
+  BenchmarkNoteStack();
+  BenchmarkStorage();
+  BenchmarkInterrupts();
+  BenchmarkLatency();
+  Print(str_end);
+  
+  // Wait for the last byte to be shifted out, and halt. simavr exits when the
+  // CPU sleeps with interrupts disabled.
+  while (!(UCSR0A & _BV(UDRE0)));
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sleep_cpu();
+  while (1);
+}
+
+}  // namespace anu
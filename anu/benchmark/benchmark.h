@@ -0,0 +1,96 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Cycle-count benchmark of the firmware hot paths.
+//
+// Built with make -f anu/benchmark/makefile, this is the regular firmware
+// in which main() runs the benchmark right after initialization. Timer 1 is
+// taken over as a cycle counter, and the results are written as a CSV table
+// on the MIDI out UART, so they can be captured from simavr (see
+// run_benchmark.py) as well as from the real hardware.
+//
+// The last rows give the minimum and maximum delay between a MIDI event and
+// its effect on the audio and CV outputs, in microseconds, for the buffer
+// policy the firmware is built with (see anu/buffer_policy.h). They are
+// computed from the policy, and have no calls and mean columns.
+
+#ifndef ANU_BENCHMARK_BENCHMARK_H_
+#define ANU_BENCHMARK_BENCHMARK_H_
+
+#include "avrlib/base.h"
+
+#include <avr/pgmspace.h>
+
+namespace anu {
+
+struct Measurement {
+  uint16_t min;
+  uint16_t max;
+  uint32_t total;
+  uint8_t count;
+
+  void Init() {
+    min = 0xffff;
+    max = 0;
+    total = 0;
+    count = 0;
+  }
+
+  void Add(uint16_t cycles) {
+    if (cycles < min) {
+      min = cycles;
+    }
+    if (cycles > max) {
+      max = cycles;
+    }
+    total += cycles;
+    ++count;
+  }
+};
+
+class Benchmark {
+ public:
+  Benchmark() { }
+  static void Run();
+
+ private:
+  static void BenchmarkDrumSynth();
+  static void BenchmarkVoice();
+  static void BenchmarkEnvelope();
+  static void BenchmarkLfo();
+  static void BenchmarkNoteStack();
+  static void BenchmarkStorage();
+  static void BenchmarkInterrupts();
+  static void BenchmarkLatency();
+
+  static void Report(
+      const prog_char* name,
+      const prog_char* variant,
+      const Measurement& measurement);
+  static void ReportLatency(
+      const prog_char* variant,
+      uint16_t min_period,
+      uint16_t max_period);
+  static void Print(const prog_char* s);
+  static void Print(uint32_t value);
+
+  DISALLOW_COPY_AND_ASSIGN(Benchmark);
+};
+
+}  // namespace anu
+
+#endif  // ANU_BENCHMARK_BENCHMARK_H_
@@ -0,0 +1,107 @@
+#!/usr/bin/env python
+#
+# Copyright 2012 Emilie Gillet.
+#
+# Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# -----------------------------------------------------------------------------
+#
+# Runs the benchmark firmware in simavr and prints the cycle counts as a
+# tab-separated table, one row per measurement, tagged with the current commit.
+# With --output, the rows are appended to a file to track the cycle counts
+# across commits. Requires Python 2.7 or later.
+
+import optparse
+import re
+import subprocess
+import sys
+
+ANSI_ESCAPE = re.compile(r'\x1b\[[0-9;]*m')
+COLUMNS = ['commit', 'name', 'variant', 'calls', 'min', 'max', 'mean']
+
+
+def CurrentCommit():
+  try:
+    return subprocess.check_output(
+        ['git', 'rev-parse', '--short', 'HEAD']).decode('ascii').strip()
+  except (OSError, subprocess.CalledProcessError):
+    return 'unknown'
+
+
+def RunSimulator(simavr, elf):
+  process = subprocess.Popen(
+      [simavr, '-m', 'atmega328p', '-f', '20000000', elf],
+      stdout=subprocess.PIPE,
+      stderr=subprocess.STDOUT)
+  output, _ = process.communicate()
+  return output.decode('ascii', 'replace')
+
+
+def ParseReport(output):
+  # simavr echoes the UART output line by line, with ANSI colors, and with
+  # the control characters (including the line terminators) replaced by dots.
+  lines = []
+  for line in output.split('\n'):
+    line = ANSI_ESCAPE.sub('', line).strip().rstrip('.')
+    lines.append(line)
+  if 'BEGIN' not in lines or 'END' not in lines:
+    return None
+  begin = lines.index('BEGIN')
+  end = lines.index('END')
+  rows = []
+  for line in lines[begin + 2:end]:
+    rows.append(line.split(','))
+  return rows
+
+
+def main(options):
+  output = RunSimulator(options.simavr, options.elf)
+  rows = ParseReport(output)
+  if rows is None:
+    sys.stderr.write(output)
+    sys.stderr.write('Could not find the benchmark report.\n')
+    return 1
+  commit = CurrentCommit()
+  table = ['\t'.join([commit] + row) for row in rows]
+  print('\t'.join(COLUMNS))
+  print('\n'.join(table))
+  if options.output:
+    f = open(options.output, 'a')
+    f.write('\n'.join(table) + '\n')
+    f.close()
+  return 0
+
+
+if __name__ == '__main__':
+  parser = optparse.OptionParser()
+  parser.add_option(
+      '-s',
+      '--simavr',
+      dest='simavr',
+      default='simavr',
+      help='Path to the simavr executable')
+  parser.add_option(
+      '-e',
+      '--elf',
+      dest='elf',
+      default='build/anu_benchmark/anu_benchmark.elf',
+      help='Benchmark firmware')
+  parser.add_option(
+      '-o',
+      '--output',
+      dest='output',
+      default=None,
+      help='Append the results to this file')
+  options, _ = parser.parse_args()
+  sys.exit(main(options))
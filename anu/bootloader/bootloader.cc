@@ -17,6 +17,16 @@
 //
 // Caveat: assumes the firmware flashing is always done from first to last
 // block, in increasing order. Random access flashing is not supported!
+//
+// A block is written by the command 0x7e, with each byte of the page and of
+// its checksum sent as two nibbles; or by the command 0x7d, with the bytes
+// packed by groups of 7: a byte holding their MSBs (bit i for the i-th byte),
+// followed by their 7 lower bits.
+//
+// The bootloader runs from the NRWW section, so it can keep polling the UART
+// while a page of the application section is erased and written. A block is
+// received into one page buffer while the other one is being flashed, and the
+// blocks can be sent back-to-back at full MIDI speed.
 
 #include <avr/boot.h>
 #include <avr/pgmspace.h>
@@ -44,7 +54,19 @@ ShiftRegisterInput<
     MSB_FIRST> inputs;
 
 uint16_t page = 0;
-uint8_t rx_buffer[2 * (SPM_PAGESIZE + 1)];
+// Each buffer holds a page and its checksum.
+uint8_t rx_buffer[2][SPM_PAGESIZE + 1];
+uint8_t* rx_page = rx_buffer[0];
+
+enum FlashWriterState {
+  FLASH_WRITER_IDLE,
+  FLASH_WRITER_ERASING,
+  FLASH_WRITER_WRITING
+};
+
+uint8_t flash_writer_state = FLASH_WRITER_IDLE;
+uint16_t flash_writer_page;
+const uint8_t* flash_writer_data;
 
 void (*main_entry_point)(void) = 0x0000;
 
@@ -54,23 +76,44 @@ inline void Init() {
   outputs.Init();
 }
 
-void WriteBufferToFlash() {
-  uint16_t i;
-  const uint8_t* p = rx_buffer;
-  eeprom_busy_wait();
-
-  boot_page_erase(page);
-  boot_spm_busy_wait();
+// Moves the erase/write of the page to its next step, once the current SPM
+// operation is complete.
+void RefreshFlashWriter() {
+  if (flash_writer_state == FLASH_WRITER_IDLE || boot_spm_busy()) {
+    return;
+  }
+  if (flash_writer_state == FLASH_WRITER_ERASING) {
+    uint16_t i;
+    const uint8_t* p = flash_writer_data;
+    for (i = 0; i < SPM_PAGESIZE; i += 2) {
+      uint16_t w = *p++;
+      w |= (*p++) << 8;
+      boot_page_fill(flash_writer_page + i, w);
+    }
+    boot_page_write(flash_writer_page);
+    flash_writer_state = FLASH_WRITER_WRITING;
+  } else {
+    boot_rww_enable();
+    flash_writer_state = FLASH_WRITER_IDLE;
+  }
+}
 
-  for (i = 0; i < SPM_PAGESIZE; i += 2) {
-    uint16_t w = *p++;
-    w |= (*p++) << 8;
-    boot_page_fill(page + i, w);
+void WaitForFlashWriter() {
+  while (flash_writer_state != FLASH_WRITER_IDLE) {
+    RefreshFlashWriter();
   }
+}
 
-  boot_page_write(page);
-  boot_spm_busy_wait();
-  boot_rww_enable();
+// Starts writing the page which has just been received, and returns without
+// waiting for the end of the erase.
+void WriteBufferToFlash() {
+  WaitForFlashWriter();
+  eeprom_busy_wait();
+  flash_writer_page = page;
+  flash_writer_data = rx_page;
+  boot_page_erase(page);
+  flash_writer_state = FLASH_WRITER_ERASING;
+  rx_page = rx_page == rx_buffer[0] ? rx_buffer[1] : rx_buffer[0];
 }
 
 static const uint8_t sysex_header[] = {
@@ -92,6 +135,7 @@ inline void MidiLoop() {
   uint8_t state = MATCHING_HEADER;
   uint8_t checksum;
   uint8_t sysex_commands[2];
+  uint8_t msbs;
   uint8_t current_led = 1;
   uint8_t status = 0;
   uint8_t progress_counter = 0;
@@ -100,7 +144,11 @@ inline void MidiLoop() {
   page = 0;
   outputs.Write(0x55 & 0x3f);
   while (1) {
-    byte = midi.Read();
+    RefreshFlashWriter();
+    if (!midi.readable()) {
+      continue;
+    }
+    byte = midi.ImmediateRead();
     // In case we see a realtime message in the stream, safely ignore it.
     if (byte > 0xf0 && byte != 0xf7) {
       continue;
@@ -138,14 +186,32 @@ inline void MidiLoop() {
 
       case READING_DATA:
         if (byte < 0x80) {
-          if (bytes_read & 1) {
-            rx_buffer[rx_buffer_index] |= byte & 0xf;
-            if (rx_buffer_index < SPM_PAGESIZE) {
-              checksum += rx_buffer[rx_buffer_index];
+          if (sysex_commands[0] == 0x7d) {
+            if (!(bytes_read & 7)) {
+              msbs = byte;
+            } else {
+              if (msbs & 1) {
+                byte |= 0x80;
+              }
+              msbs >>= 1;
+              if (rx_buffer_index < sizeof(rx_buffer[0])) {
+                rx_page[rx_buffer_index] = byte;
+                if (rx_buffer_index < SPM_PAGESIZE) {
+                  checksum += byte;
+                }
+              }
+              ++rx_buffer_index;
+            }
+          } else if (bytes_read & 1) {
+            if (rx_buffer_index < sizeof(rx_buffer[0])) {
+              rx_page[rx_buffer_index] |= byte & 0xf;
+              if (rx_buffer_index < SPM_PAGESIZE) {
+                checksum += rx_page[rx_buffer_index];
+              }
             }
             ++rx_buffer_index;
-          } else {
-            rx_buffer[rx_buffer_index] = (byte << 4);
+          } else if (rx_buffer_index < sizeof(rx_buffer[0])) {
+            rx_page[rx_buffer_index] = (byte << 4);
           }
           ++bytes_read;
         } else if (byte == 0xf7) {
@@ -153,11 +219,13 @@ inline void MidiLoop() {
               sysex_commands[1] == 0x00 &&
               bytes_read == 0) {
             // Reset.
+            WaitForFlashWriter();
             return;
           } else if (rx_buffer_index == SPM_PAGESIZE + 1 &&
-                     sysex_commands[0] == 0x7e &&
+                     (sysex_commands[0] == 0x7e ||
+                      sysex_commands[0] == 0x7d) &&
                      sysex_commands[1] == 0x00 &&
-                     rx_buffer[rx_buffer_index - 1] == checksum) {
+                     rx_page[rx_buffer_index - 1] == checksum) {
             // Block write.
             WriteBufferToFlash();
             page += SPM_PAGESIZE;
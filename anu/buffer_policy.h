@@ -0,0 +1,63 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Sizes of the buffers between the main loop and the interrupts, which trade
+// latency for CPU: longer buffers need fewer, longer renders (less per-block
+// overhead), shorter buffers reduce the delay between a MIDI event and the
+// corresponding sound or CV change.
+//
+// The policy is selected at compile time:
+// - ANU_LOW_LATENCY: for live-played drums.
+// - ANU_HIGH_THROUGHPUT: for pattern playback.
+// - otherwise, the default, in-between profile.
+
+#ifndef ANU_BUFFER_POLICY_H_
+#define ANU_BUFFER_POLICY_H_
+
+#include "avrlib/base.h"
+
+namespace anu {
+
+// audio_block_size must be a power of 2 between 8 and 128, and
+// dac_state_buffer_size a power of 2.
+template<uint8_t audio_block_size_, uint8_t dac_state_buffer_size_>
+struct BufferPolicy {
+  enum {
+    audio_block_size = audio_block_size_,
+    dac_state_buffer_size = dac_state_buffer_size_
+  };
+};
+
+typedef BufferPolicy<16, 2> LowLatencyBufferPolicy;
+typedef BufferPolicy<32, 4> DefaultBufferPolicy;
+typedef BufferPolicy<64, 8> HighThroughputBufferPolicy;
+
+#if defined(ANU_LOW_LATENCY)
+typedef LowLatencyBufferPolicy ActiveBufferPolicy;
+#elif defined(ANU_HIGH_THROUGHPUT)
+typedef HighThroughputBufferPolicy ActiveBufferPolicy;
+#else
+typedef DefaultBufferPolicy ActiveBufferPolicy;
+#endif  // ANU_LOW_LATENCY
+
+// Duration of the audio and DAC interrupt periods, in 1/10 of microseconds.
+static const uint16_t kAudioSamplePeriod = 255;  // 510 cycles at 20MHz.
+static const uint16_t kDACSamplePeriod = 4080;  // 16 audio samples.
+
+}  // namespace anu
+
+#endif  // ANU_BUFFER_POLICY_H_
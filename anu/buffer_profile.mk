@@ -0,0 +1,36 @@
+# Copyright 2012 Emilie Gillet.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#
+# -----------------------------------------------------------------------------
+#
+# Selection of the buffer policy (see anu/buffer_policy.h), shared by the
+# firmware, benchmark and host makefiles:
+#
+# make -f anu/makefile BUFFER_PROFILE=low_latency
+# make -f anu/makefile BUFFER_PROFILE=high_throughput
+#
+# The name of the target, and thus of the build directory, is suffixed with the
+# name of the profile.
+
+ifeq ($(BUFFER_PROFILE),low_latency)
+BUFFER_PROFILE_DEFINES = -DANU_LOW_LATENCY
+else ifeq ($(BUFFER_PROFILE),high_throughput)
+BUFFER_PROFILE_DEFINES = -DANU_HIGH_THROUGHPUT
+else ifneq ($(BUFFER_PROFILE),)
+$(error Unknown buffer profile: $(BUFFER_PROFILE))
+endif
+
+ifneq ($(BUFFER_PROFILE),)
+BUFFER_PROFILE_SUFFIX = _$(BUFFER_PROFILE)
+endif
@@ -16,7 +16,6 @@
 #include "anu/drum_synth.h"
 
 #include "avrlib/op.h"
-#include "avrlib/random.h"
 #include "avrlib/time.h"
 
 #include "anu/audio_buffer.h"
@@ -27,6 +26,19 @@ namespace anu {
 
 using namespace avrlib;
 
+// The drum envelopes are stepped every kDrumControlPeriod samples, whatever
+// the size of the audio blocks. The blocks are rendered in slices of
+// kDrumSliceSize samples, with constant modulations within a slice.
+static const uint8_t kDrumControlPeriod = 32;
+static const uint8_t kDrumSliceSize = kAudioBlockSize < kDrumControlPeriod ? \
+    kAudioBlockSize : kDrumControlPeriod;
+static const uint8_t kNumDrumSlicesPerBlock = kAudioBlockSize / kDrumSliceSize;
+static const uint8_t kNumDrumSlicesPerControlPeriod = \
+    kDrumControlPeriod / kDrumSliceSize;
+
+// Delay, in samples, between the reception of a trigger and its playback.
+static const uint8_t kDrumTriggerLatency = kNumAudioBlocks * kAudioBlockSize;
+
 /* extern */
 DrumSynth drum_synth;
 
@@ -49,7 +61,31 @@ uint8_t DrumSynth::sample_;
 uint8_t DrumSynth::fade_counter_;
 
 /* static */
-bool DrumSynth::playing_;
+uint8_t DrumSynth::slice_counter_;
+
+/* static */
+uint8_t DrumSynth::random_;
+
+/* static */
+uint8_t DrumSynth::noise_;
+
+/* static */
+uint16_t DrumSynth::rng_state_;
+
+/* static */
+uint8_t DrumSynth::active_voices_;
+
+/* static */
+uint8_t DrumSynth::audible_voices_;
+
+/* static */
+uint8_t DrumSynth::scheduled_voices_;
+
+/* static */
+uint8_t DrumSynth::scheduled_position_[kNumDrumInstruments];
+
+/* static */
+uint8_t DrumSynth::scheduled_velocity_[kNumDrumInstruments];
 
 /* static */
 uint32_t DrumSynth::last_event_time_;
@@ -95,6 +131,16 @@ static const prog_uint8_t* drum_presets[] = {
 /* static */
 void DrumSynth::Init() {
   memset(state_, 0, sizeof(DrumState) * kNumDrumInstruments);
+  active_voices_ = 0;
+  audible_voices_ = 0;
+  scheduled_voices_ = 0;
+  slice_counter_ = 0;
+  random_ = 0;
+  noise_ = 0;
+  rng_state_ = 0x21;
+  sample_ = 0;
+  sample_counter_ = 0;
+  fade_counter_ = 0;
 }
 
 /* static */
@@ -112,7 +158,43 @@ void DrumSynth::Trigger(uint8_t instrument, uint8_t level) {
   state_[instrument].amp_env_increment = pgm_read_word(
       lut_res_drm_env_increments + patch_[instrument].amp_decay);
   state_[instrument].level = U8U8MulShift8(level, patch_[instrument].level);
-  playing_ = true;
+  active_voices_ |= 1 << instrument;
+}
+
+/* static */
+void DrumSynth::Trigger(uint8_t instrument, uint8_t level, uint8_t position) {
+  // A trigger still scheduled for the same instrument is replaced: it would
+  // have been cut by this one within less than the latency anyway.
+  scheduled_position_[instrument] = position + kDrumTriggerLatency;
+  scheduled_velocity_[instrument] = level;
+  scheduled_voices_ |= 1 << instrument;
+}
+
+/* static */
+uint8_t DrumSynth::ApplyScheduledTriggers(uint8_t position, uint8_t size) {
+  // Plays the triggers scheduled at or before the current position, and
+  // returns the number of samples, at most size, before the next one.
+  for (uint8_t i = 0; i < kNumDrumInstruments; ++i) {
+    uint8_t mask = 1 << i;
+    if (!(scheduled_voices_ & mask)) {
+      continue;
+    }
+    // A trigger is never scheduled more than kDrumTriggerLatency samples
+    // ahead, so a larger distance means that the position has already gone
+    // past it (the main loop has been busy), however late it is.
+    uint8_t delay = scheduled_position_[i] - position;
+    if (delay == 0 || delay > kDrumTriggerLatency) {
+      // The modulations of the voice are computed right away rather than at
+      // the next control period, so that it starts on this very sample. Late
+      // triggers are played immediately.
+      scheduled_voices_ &= ~mask;
+      Trigger(i, scheduled_velocity_[i]);
+      UpdateVoiceModulations(i);
+    } else if (delay < size) {
+      size = delay;
+    }
+  }
+  return size;
 }
 
 /* static */
@@ -176,75 +258,392 @@ void DrumSynth::FillWithSilence() {
     }
   }
   while (audio_buffer.writable()) {
-    audio_buffer.Overwrite(sample_);
+    memset(audio_buffer.write_block(), sample_, kAudioBlockSize);
+    audio_buffer.Commit();
   }
 }
 
+// Coefficients for advancing the noise generator (noise = noise * 73 + 1) by
+// n steps at once: noise = noise * noise_skip_a[n] + noise_skip_b[n].
+static const prog_uint8_t noise_skip_a[] PROGMEM = {
+  1, 73, 209, 153, 161, 233, 113, 57, 65, 137, 17, 217, 225, 41, 177, 121,
+  129, 201, 81, 25, 33, 105, 241, 185, 193, 9, 145, 89, 97, 169, 49, 249,
+  1
+};
+
+static const prog_uint8_t noise_skip_b[] PROGMEM = {
+  0, 1, 74, 27, 180, 85, 62, 175, 232, 41, 178, 195, 156, 125, 166, 87,
+  208, 81, 26, 107, 132, 165, 14, 255, 184, 121, 130, 19, 108, 205, 118, 167,
+  160
+};
+
 /* static */
-void DrumSynth::Render() {
-  uint8_t sample = sample_;
-  uint8_t sample_counter = sample_counter_;
-  while (audio_buffer.writable() >= kAudioBlockSize) {
-    UpdateModulations();
-    uint8_t noise = Random::state_msb();
-    uint16_t phase_0 = state_[0].phase;
-    uint16_t phase_1 = state_[1].phase;
-    uint16_t phase_2 = state_[2].phase;
-    for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
-      ++sample_counter;
-      int16_t mix = 128;
-      noise = (noise * 73) + 1;
+template<uint8_t voices>
+inline uint8_t DrumSynth::RenderSample(
+    uint16_t phase_0,
+    uint16_t phase_1,
+    uint16_t phase_2,
+    uint8_t noise) {
+  int16_t mix = 128;
+  
+  if (voices & 1) {
+    // Linear interpolation optimized for the case when the delta
+    // between adjacent samples is in the -127..+127 range.
+    Word bd_sample_pair;
+    bd_sample_pair.value = pgm_read_word(wav_res_sine + (phase_0 >> 8));
+    int8_t bd = bd_sample_pair.bytes[0];
+    int8_t bd_2 = bd_sample_pair.bytes[1];
+    bd += S8U8MulShift8(bd_2 - bd, phase_0);
+    mix += S8U8MulShift8(bd, state_[0].amp_level);
+  }
+
+  if (voices & 2) {
+    int8_t sd = pgm_read_byte(wav_res_sine + (phase_1 >> 8));
+    mix += S8U8MulShift8(sd, state_[1].amp_level);
+    mix += S8U8MulShift8(noise, state_[1].amp_level_noise);
+  }
 
+  if (voices & 4) {
+    int8_t hh = pgm_read_byte(wav_res_hh + U16ShiftRight4(phase_2));
+    mix += S8U8MulShift8(hh, state_[2].amp_level);
+  }
+  
+  if (mix > 255) mix = 255;
+  if (mix < 0) mix = 0;
+  return mix;
+}
+
+/* static */
+template<uint8_t voices>
+inline void DrumSynth::RenderBlock(uint8_t* out, uint8_t size) {
+  uint8_t sample = 128;
+  uint8_t noise = noise_;
+  uint16_t phase_0 = state_[0].phase;
+  uint16_t phase_1 = state_[1].phase;
+  uint16_t phase_2 = state_[2].phase;
+  for (uint8_t i = 0; i < size; ++i) {
+    if (voices & 1) {
       phase_0 += state_[0].phase_increment;
+    }
+    if (voices & 2) {
+      noise = (noise * 73) + 1;
       phase_1 += state_[1].phase_increment;
+    }
+    if (voices & 4) {
       phase_2 += state_[2].phase_increment;
-      
-      // Linear interpolation optimized for the case when the delta
-      // between adjacent samples is in the -127..+127 range.
-      Word bd_sample_pair;
-      bd_sample_pair.value = pgm_read_word(wav_res_sine + (phase_0 >> 8));
-      int8_t bd = bd_sample_pair.bytes[0];
-      int8_t bd_2 = bd_sample_pair.bytes[1];
-      bd += S8U8MulShift8(bd_2 - bd, phase_0);
-      mix += S8U8MulShift8(bd, state_[0].amp_level);
-
-      int8_t sd = pgm_read_byte(wav_res_sine + (phase_1 >> 8));
-      mix += S8U8MulShift8(sd, state_[1].amp_level);
-      mix += S8U8MulShift8(noise, state_[1].amp_level_noise);
-
-      int8_t hh = pgm_read_byte(wav_res_hh + U16ShiftRight4(phase_2));
-      mix += S8U8MulShift8(hh, state_[2].amp_level);
-      
-      if (sample_counter > sample_rate_) {
-        if (mix > 255) mix = 255;
-        if (mix < 0) mix = 0;
-        sample = mix;
-        sample_counter = 0;
+    }
+    sample = RenderSample<voices>(phase_0, phase_1, phase_2, noise);
+    *out++ = sample;
+  }
+  
+  // The phases of the silent voices are advanced by the whole slice, so that
+  // they stay in sync should they become audible again.
+  if (!(voices & 1)) {
+    phase_0 += state_[0].phase_increment * size;
+  }
+  if (!(voices & 2)) {
+    phase_1 += state_[1].phase_increment * size;
+  }
+  if (!(voices & 4)) {
+    phase_2 += state_[2].phase_increment * size;
+  }
+  state_[0].phase = phase_0;
+  state_[1].phase = phase_1;
+  state_[2].phase = phase_2;
+  noise_ = noise;
+  sample_ = sample;
+}
+
+// The hand-scheduled kernel below has not been built with avr-gcc yet: it is
+// only compiled in the benchmark firmware built with DRUM_KERNEL=asm (see
+// anu/benchmark/makefile), until its register allocation and cycle count have
+// been checked against those of the C++ kernel.
+#if defined(USE_OPTIMIZED_OP) && defined(ANU_ASM_DRUM_KERNEL)
+
+// Sign-extends the result of the last multiplication (r1) and adds it to the
+// 16-bit mix.
+#define DRUM_MIX_ACCUMULATE \
+  "add %[mix_lo], r1"                 "\n\t" \
+  "adc %[mix_hi], %[zero]"            "\n\t" \
+  "sbrc r1, 7"                        "\n\t" \
+  "dec %[mix_hi]"                     "\n\t"
+
+// Hand-scheduled version of the kernel used when all three voices are
+// audible. The phases, increments and amp levels stay in registers for the
+// whole block; S8U8MulShift8 is a mulsu whose result is the high byte (r1).
+// The samples are clipped and stored with a post-increment directly in the
+// audio buffer block. The end of the slice is detected from the lower byte of
+// the pointer, the aligned audio buffer not crossing a 256-byte boundary.
+/* static */
+template<>
+inline void DrumSynth::RenderBlock<kAllDrumVoices>(uint8_t* out, uint8_t size) {
+  uint8_t end = static_cast<uint8_t>(reinterpret_cast<uintptr_t>(out)) + size;
+  uint8_t noise = noise_;
+  uint16_t phase_0 = state_[0].phase;
+  uint16_t phase_1 = state_[1].phase;
+  uint16_t phase_2 = state_[2].phase;
+  uint8_t ta, tb, tc, mix_lo, mix_hi, zero;
+  asm volatile(
+    "clr %[zero]"                       "\n\t"
+  "1:"                                  "\n\t"
+    // noise = noise * 73 + 1
+    "ldi %[tc], 73"                     "\n\t"
+    "mul %[noise], %[tc]"               "\n\t"
+    "mov %[noise], r0"                  "\n\t"
+    "inc %[noise]"                      "\n\t"
+    // Advance the phases.
+    "add %A[p0], %A[i0]"                "\n\t"
+    "adc %B[p0], %B[i0]"                "\n\t"
+    "add %A[p1], %A[i1]"                "\n\t"
+    "adc %B[p1], %B[i1]"                "\n\t"
+    "add %A[p2], %A[i2]"                "\n\t"
+    "adc %B[p2], %B[i2]"                "\n\t"
+    // BD: the two bytes of the sample pair are read with lpm Z+, and
+    // linearly interpolated with the fractional part of the phase.
+    "ldi r30, lo8(%[sine])"             "\n\t"
+    "ldi r31, hi8(%[sine])"             "\n\t"
+    "add r30, %B[p0]"                   "\n\t"
+    "adc r31, %[zero]"                  "\n\t"
+    "lpm %[ta], Z+"                     "\n\t"
+    "lpm %[tb], Z"                      "\n\t"
+    "sub %[tb], %[ta]"                  "\n\t"
+    "mov %[tc], %A[p0]"                 "\n\t"
+    "mulsu %[tb], %[tc]"                "\n\t"
+    "add %[ta], r1"                     "\n\t"
+    "mulsu %[ta], %[a0]"                "\n\t"
+    "ldi %[mix_lo], 128"                "\n\t"
+    "clr %[mix_hi]"                     "\n\t"
+    DRUM_MIX_ACCUMULATE
+    // SD: sine and noise.
+    "ldi r30, lo8(%[sine])"             "\n\t"
+    "ldi r31, hi8(%[sine])"             "\n\t"
+    "add r30, %B[p1]"                   "\n\t"
+    "adc r31, %[zero]"                  "\n\t"
+    "lpm %[ta], Z"                      "\n\t"
+    "mulsu %[ta], %[a1]"                "\n\t"
+    DRUM_MIX_ACCUMULATE
+    "mov %[ta], %[noise]"               "\n\t"
+    "mulsu %[ta], %[an]"                "\n\t"
+    DRUM_MIX_ACCUMULATE
+    // HH: 12-bit index into the hi-hat sample.
+    "movw r30, %A[p2]"                  "\n\t"
+    "lsr r31"                           "\n\t"
+    "ror r30"                           "\n\t"
+    "lsr r31"                           "\n\t"
+    "ror r30"                           "\n\t"
+    "lsr r31"                           "\n\t"
+    "ror r30"                           "\n\t"
+    "lsr r31"                           "\n\t"
+    "ror r30"                           "\n\t"
+    "subi r30, lo8(-(%[hh]))"           "\n\t"
+    "sbci r31, hi8(-(%[hh]))"           "\n\t"
+    "lpm %[ta], Z"                      "\n\t"
+    "mulsu %[ta], %[a2]"                "\n\t"
+    DRUM_MIX_ACCUMULATE
+    // Clip to 0..255 and store.
+    "tst %[mix_hi]"                     "\n\t"
+    "breq 2f"                           "\n\t"
+    "clr %[mix_lo]"                     "\n\t"
+    "sbrs %[mix_hi], 7"                 "\n\t"
+    "com %[mix_lo]"                     "\n\t"
+  "2:"                                  "\n\t"
+    "st X+, %[mix_lo]"                  "\n\t"
+    "cp r26, %[end]"                    "\n\t"
+    // The loop is too long for a brne.
+    "breq 3f"                           "\n\t"
+    "rjmp 1b"                           "\n\t"
+  "3:"                                  "\n\t"
+    "clr r1"                            "\n\t"
+    : [p0] "+r" (phase_0),
+      [p1] "+r" (phase_1),
+      [p2] "+r" (phase_2),
+      [noise] "+r" (noise),
+      [out] "+x" (out),
+      [ta] "=&a" (ta),
+      [tb] "=&a" (tb),
+      [tc] "=&a" (tc),
+      [mix_lo] "=&d" (mix_lo),
+      [mix_hi] "=&r" (mix_hi),
+      [zero] "=&r" (zero)
+    : [i0] "r" (state_[0].phase_increment),
+      [i1] "r" (state_[1].phase_increment),
+      [i2] "r" (state_[2].phase_increment),
+      [a0] "a" (state_[0].amp_level),
+      [a1] "a" (state_[1].amp_level),
+      [an] "a" (state_[1].amp_level_noise),
+      [a2] "a" (state_[2].amp_level),
+      [sine] "i" (wav_res_sine),
+      [hh] "i" (wav_res_hh),
+      [end] "r" (end)
+    : "r30", "r31", "memory"
+  );
+  state_[0].phase = phase_0;
+  state_[1].phase = phase_1;
+  state_[2].phase = phase_2;
+  noise_ = noise;
+  sample_ = out[-1];
+}
+
+#endif  // USE_OPTIMIZED_OP && ANU_ASM_DRUM_KERNEL
+
+/* static */
+inline void DrumSynth::StepModulations() {
+  if (kNumDrumSlicesPerControlPeriod == 1) {
+    UpdateModulations();
+    return;
+  }
+  if (!slice_counter_) {
+    UpdateModulations();
+  }
+  if (++slice_counter_ == kNumDrumSlicesPerControlPeriod) {
+    slice_counter_ = 0;
+  }
+}
+
+/* static */
+inline void DrumSynth::RenderSlice(uint8_t* out, uint8_t size) {
+  if (sample_rate_) {
+    RenderDecimated(out, size);
+    return;
+  }
+  // Dispatch to a kernel specialized for the voices which are audible during
+  // this slice.
+  switch (audible_voices_) {
+    case 0: RenderBlock<0>(out, size); break;
+    case 1: RenderBlock<1>(out, size); break;
+    case 2: RenderBlock<2>(out, size); break;
+    case 3: RenderBlock<3>(out, size); break;
+    case 4: RenderBlock<4>(out, size); break;
+    case 5: RenderBlock<5>(out, size); break;
+    case 6: RenderBlock<6>(out, size); break;
+    case 7: RenderBlock<7>(out, size); break;
+  }
+}
+
+/* static */
+void DrumSynth::Render() {
+  while (audio_buffer.writable()) {
+    uint8_t* out = audio_buffer.write_block();
+    uint8_t position = audio_buffer.write_position();
+    for (uint8_t i = 0; i < kNumDrumSlicesPerBlock; ++i) {
+      StepModulations();
+      // The slice is split at the scheduled triggers.
+      uint8_t remaining = kDrumSliceSize;
+      while (remaining) {
+        uint8_t size = remaining;
+        if (scheduled_voices_) {
+          size = ApplyScheduledTriggers(position, size);
+        }
+        RenderSlice(out, size);
+        out += size;
+        position += size;
+        remaining -= size;
       }
-      audio_buffer.Overwrite(sample);
     }
-    state_[0].phase = phase_0;
-    state_[1].phase = phase_1;
-    state_[2].phase = phase_2;
+    audio_buffer.Commit();
+  }
+  if (!sample_rate_) {
+    sample_counter_ = 0;
+  }
+  fade_counter_ = 255;
+}
+
+/* static */
+void DrumSynth::RenderDecimated(uint8_t* out, uint8_t size) {
+  // Only one sample every sample_rate_ + 1 is kept, and held for the
+  // following ones. The phases and the noise generator are advanced by
+  // the whole stride at once, and the mix is computed only for the samples
+  // that are kept.
+  uint8_t sample = sample_;
+  uint8_t sample_counter = sample_counter_;
+  uint8_t stride = sample_rate_ + 1;
+  uint8_t noise_a = pgm_read_byte(noise_skip_a + stride);
+  uint8_t noise_b = pgm_read_byte(noise_skip_b + stride);
+  uint8_t noise = noise_;
+  uint16_t phase_0 = state_[0].phase;
+  uint16_t phase_1 = state_[1].phase;
+  uint16_t phase_2 = state_[2].phase;
+  uint16_t increment_0 = state_[0].phase_increment;
+  uint16_t increment_1 = state_[1].phase_increment;
+  uint16_t increment_2 = state_[2].phase_increment;
+  uint16_t stride_increment_0 = increment_0 * stride;
+  uint16_t stride_increment_1 = increment_1 * stride;
+  uint16_t stride_increment_2 = increment_2 * stride;
+  
+  // Number of samples until the next one to keep. It can be shorter than
+  // the stride for the first one of the slice.
+  uint8_t skip = sample_counter >= stride ? 1 : stride - sample_counter;
+  uint8_t remaining = size;
+  while (skip <= remaining) {
+    if (skip == stride) {
+      phase_0 += stride_increment_0;
+      phase_1 += stride_increment_1;
+      phase_2 += stride_increment_2;
+      noise = noise * noise_a + noise_b;
+    } else {
+      phase_0 += increment_0 * skip;
+      phase_1 += increment_1 * skip;
+      phase_2 += increment_2 * skip;
+      noise = noise * pgm_read_byte(noise_skip_a + skip) + \
+          pgm_read_byte(noise_skip_b + skip);
+    }
+    remaining -= skip;
+    while (--skip) {
+      *out++ = sample;
+    }
+    sample = RenderSample<kAllDrumVoices>(phase_0, phase_1, phase_2, noise);
+    *out++ = sample;
+    sample_counter = 0;
+    skip = stride;
   }
+  
+  // The remaining samples of the slice are held.
+  phase_0 += increment_0 * remaining;
+  phase_1 += increment_1 * remaining;
+  phase_2 += increment_2 * remaining;
+  sample_counter += remaining;
+  while (remaining--) {
+    *out++ = sample;
+  }
+  state_[0].phase = phase_0;
+  state_[1].phase = phase_1;
+  state_[2].phase = phase_2;
+  noise_ = noise;
   sample_ = sample;
   sample_counter_ = sample_counter;
-  fade_counter_ = 255;
 }
 
 /* static */
 void DrumSynth::UpdateModulations() {
-  playing_ = false;
+  // The drum synth draws from its own random sequence (the same LFSR as
+  // avrlib::Random), so that its sound does not depend on how many random
+  // numbers the other modules have drawn since the last control period,
+  // which varies with the size of the audio blocks. The random pitch
+  // modulation of the BD is always drawn, so that the sequence does not
+  // depend on which voices are active either.
+  rng_state_ = (rng_state_ >> 1) ^ (-(rng_state_ & 1) & 0xb400);
+  random_ = rng_state_ >> 8;
+  // The noise generator is reseeded once per control period, and carries
+  // over from one slice to the next within the period.
+  noise_ = random_;
   for (uint8_t i = 0; i < kNumDrumInstruments; ++i) {
+    uint8_t mask = 1 << i;
+    if (!(active_voices_ & mask)) {
+      // The amp envelope has reached 0: the voice is silent until it is
+      // triggered again, which resets its phases.
+      state_[i].amp_level = 0;
+      state_[i].amp_level_noise = 0;
+      audible_voices_ &= ~mask;
+      continue;
+    }
+    
     // Step amp envelope.
     state_[i].amp_env_phase += state_[i].amp_env_increment;
     if (state_[i].amp_env_phase < state_[i].amp_env_increment) {
       state_[i].amp_env_phase = 0xffff;
       state_[i].amp_env_increment = 0;
+      active_voices_ &= ~mask;
     }
-    state_[i].amp_level = U8U8MulShift8(
-        state_[i].level,
-        InterpolateSample(wav_res_drm_envelope, state_[i].amp_env_phase));
     
     // Step pitch envelope.
     state_[i].pitch_env_phase += state_[i].pitch_env_increment;
@@ -252,30 +651,45 @@ void DrumSynth::UpdateModulations() {
       state_[i].pitch_env_phase = 0xffff;
       state_[i].pitch_env_increment = 0;
     }
+    UpdateVoiceModulations(i);
+  }
+}
 
-    // Compute pitch
-    uint16_t pitch = static_cast<uint16_t>(patch_[i].pitch) << 8;
-    if (i == 0) {
-      pitch += U8U8Mul(Random::GetByte(), patch_[i].crunchiness);
-    }
-    pitch += U8U8Mul(
-        patch_[i].pitch_mod,
-        InterpolateSample(wav_res_drm_envelope, state_[i].pitch_env_phase));
-    state_[i].phase_increment = InterpolateIncreasing(
-        lut_res_drm_phase_increments,
-        pitch);
-        
-    if (state_[i].amp_env_increment) {
-      playing_ = true;
-    }
+/* static */
+void DrumSynth::UpdateVoiceModulations(uint8_t i) {
+  uint8_t amp_level = U8U8MulShift8(
+      state_[i].level,
+      InterpolateSample(wav_res_drm_envelope, state_[i].amp_env_phase));
+  
+  // Compute pitch
+  uint16_t pitch = static_cast<uint16_t>(patch_[i].pitch) << 8;
+  if (i == 0) {
+    pitch += U8U8Mul(random_, patch_[i].crunchiness);
+  }
+  pitch += U8U8Mul(
+      patch_[i].pitch_mod,
+      InterpolateSample(wav_res_drm_envelope, state_[i].pitch_env_phase));
+  state_[i].phase_increment = InterpolateIncreasing(
+      lut_res_drm_phase_increments,
+      pitch);
+  if (i == 2) {
+    state_[i].phase_increment >>= 6;
+  }
+  
+  uint8_t mask = 1 << i;
+  if (amp_level) {
+    audible_voices_ |= mask;
+  } else {
+    audible_voices_ &= ~mask;
+  }
+  if (i == 1) {
+    // The SD is a mix of a sine and noise.
+    state_[i].amp_level_noise = U8U8MulShift8(
+        amp_level,
+        patch_[i].crunchiness);
+    amp_level = U8U8MulShift8(amp_level, ~patch_[i].crunchiness);
   }
-  state_[1].amp_level_noise = U8U8MulShift8(
-      state_[1].amp_level,
-      patch_[1].crunchiness);
-  state_[1].amp_level = U8U8MulShift8(
-      state_[1].amp_level,
-      ~patch_[1].crunchiness);
-  state_[2].phase_increment >>= 6;
+  state_[i].amp_level = amp_level;
 }
 
 /* static */
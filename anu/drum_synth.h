@@ -23,6 +23,7 @@
 namespace anu {
 
 static const uint8_t kNumDrumInstruments = 3;
+static const uint8_t kAllDrumVoices = (1 << kNumDrumInstruments) - 1;
 
 struct DrumPatch {
   uint8_t pitch;
@@ -51,6 +52,10 @@ class DrumSynth {
   ~DrumSynth() { }
   static void Init();
   static void Trigger(uint8_t instrument, uint8_t velocity);
+  // Triggers an instrument at a constant latency of kNumAudioBlocks blocks
+  // after the sample which was playing when the event was received (see
+  // AudioBuffer::read_position()), rather than at the next control period.
+  static void Trigger(uint8_t instrument, uint8_t velocity, uint8_t position);
   static void SetParameterCc(uint8_t cc, uint8_t value);
   static void MorphPatch(uint8_t instrument, uint8_t value);
   static void SetBalance(uint8_t value);
@@ -58,10 +63,25 @@ class DrumSynth {
   static void Render();
   static void FillWithSilence();
   static uint32_t idle_time_ms();
-  static bool playing() { return playing_; }
+  static bool playing() { return active_voices_ || scheduled_voices_; }
   
  private:
+  friend class Benchmark;
+  
   static void UpdateModulations();
+  static void UpdateVoiceModulations(uint8_t instrument);
+  static uint8_t ApplyScheduledTriggers(uint8_t position, uint8_t size);
+  static inline void StepModulations();
+  static inline void RenderSlice(uint8_t* out, uint8_t size);
+  static void RenderDecimated(uint8_t* out, uint8_t size);
+  template<uint8_t voices>
+  static inline void RenderBlock(uint8_t* out, uint8_t size);
+  template<uint8_t voices>
+  static inline uint8_t RenderSample(
+      uint16_t phase_0,
+      uint16_t phase_1,
+      uint16_t phase_2,
+      uint8_t noise);
   
   static DrumPatch patch_[kNumDrumInstruments];
   static DrumState state_[kNumDrumInstruments];
@@ -70,8 +90,21 @@ class DrumSynth {
   static uint8_t sample_counter_;
   static uint8_t sample_rate_;
   static uint8_t fade_counter_;
+  static uint8_t slice_counter_;
+  static uint8_t random_;
+  static uint8_t noise_;
+  static uint16_t rng_state_;
   static uint32_t last_event_time_;
-  static bool playing_;
+  
+  // Bit i is set while the amp envelope of voice i is running.
+  static uint8_t active_voices_;
+  // Bit i is set when voice i has a non-zero level in the current block.
+  static uint8_t audible_voices_;
+  // Bit i is set when voice i has a trigger scheduled at the position
+  // scheduled_position_[i], with the level scheduled_velocity_[i].
+  static uint8_t scheduled_voices_;
+  static uint8_t scheduled_position_[kNumDrumInstruments];
+  static uint8_t scheduled_velocity_[kNumDrumInstruments];
   
   DISALLOW_COPY_AND_ASSIGN(DrumSynth);
 };
@@ -0,0 +1,142 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Background writer of the EEPROM.
+
+#include "anu/eeprom_writer.h"
+
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+namespace anu {
+
+/* static */
+EepromWriteRequest EepromWriter::requests_[kEepromWriterQueueSize];
+
+/* static */
+volatile uint8_t EepromWriter::read_ptr_;
+
+/* static */
+volatile uint8_t EepromWriter::write_ptr_;
+
+/* static */
+uint16_t EepromWriter::position_;
+
+/* static */
+uint8_t EepromWriter::checksum_;
+
+/* static */
+void EepromWriter::Init() {
+  EECR &= ~_BV(EERIE);
+  read_ptr_ = 0;
+  write_ptr_ = 0;
+  position_ = 0;
+  checksum_ = 0;
+}
+
+/* static */
+EepromWriteRequest* EepromWriter::Find(const uint8_t* address) {
+  // The request being written is not considered: it might already have gone
+  // past the bytes which have changed.
+  uint8_t r = read_ptr_;
+  uint8_t w = write_ptr_;
+  if (r != w) {
+    for (uint8_t i = (r + 1) & (kEepromWriterQueueSize - 1);
+         i != w;
+         i = (i + 1) & (kEepromWriterQueueSize - 1)) {
+      if (requests_[i].address == address) {
+        return &requests_[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+/* static */
+bool EepromWriter::queued(const uint8_t* address) {
+  cli();
+  bool found = Find(address) != NULL;
+  sei();
+  return found;
+}
+
+/* static */
+bool EepromWriter::Write(const void* data, uint8_t* address, uint16_t size) {
+  // A waiting request for the same object is updated, in case its size has
+  // changed.
+  cli();
+  EepromWriteRequest* waiting = Find(address);
+  if (waiting) {
+    waiting->data = static_cast<const uint8_t*>(data);
+    waiting->size = size;
+  }
+  sei();
+  if (waiting) {
+    return true;
+  }
+  // A request takes up to a few hundred ms to complete: the main loop cannot
+  // wait for a slot to be freed.
+  uint8_t w = write_ptr_;
+  if (((w + 1) & (kEepromWriterQueueSize - 1)) == read_ptr_) {
+    return false;
+  }
+  EepromWriteRequest* request = &requests_[w];
+  request->data = static_cast<const uint8_t*>(data);
+  request->address = address;
+  request->size = size;
+  write_ptr_ = (w + 1) & (kEepromWriterQueueSize - 1);
+  EECR |= _BV(EERIE);
+  return true;
+}
+
+/* static */
+void EepromWriter::WriteNextByte() {
+  uint8_t r = read_ptr_;
+  if (r == write_ptr_) {
+    // Nothing left to write.
+    EECR &= ~_BV(EERIE);
+    return;
+  }
+  const EepromWriteRequest& request = requests_[r];
+  for (uint8_t i = 0; i < kEepromWriterScanSize; ++i) {
+    uint8_t* address = request.address + position_;
+    uint8_t value;
+    if (position_ == request.size) {
+      value = checksum_;
+      position_ = 0;
+      checksum_ = 0;
+      read_ptr_ = (r + 1) & (kEepromWriterQueueSize - 1);
+    } else {
+      value = request.data[position_];
+      checksum_ += value;
+      ++position_;
+    }
+    if (eeprom_read_byte(address) != value) {
+      eeprom_write_byte(address, value);
+      return;
+    }
+    if (!position_) {
+      return;
+    }
+  }
+}
+
+/* extern */
+EepromWriter eeprom_writer;
+
+}  // namespace anu
@@ -0,0 +1,86 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Background writer of the EEPROM.
+//
+// Writing a byte to the EEPROM takes 3.4ms, during which the CPU is free.
+// Rather than waiting for the end of each write, the objects to save are
+// queued, and written one byte at a time by the EE_READY interrupt. Only the
+// bytes which differ from the content of the EEPROM are written. The checksum
+// following the object is written last, and is computed from the values
+// which have been compared or written, so the stored copy stays consistent
+// even if the object is modified while it is being saved.
+
+#ifndef ANU_EEPROM_WRITER_H_
+#define ANU_EEPROM_WRITER_H_
+
+#include "avrlib/base.h"
+
+namespace anu {
+
+struct EepromWriteRequest {
+  const uint8_t* data;
+  uint8_t* address;
+  uint16_t size;
+};
+
+static const uint8_t kEepromWriterQueueSize = 8;
+
+// Number of bytes compared by each run of the interrupt, when they are found
+// unchanged.
+static const uint8_t kEepromWriterScanSize = 8;
+
+class EepromWriter {
+ public:
+  EepromWriter() { }
+  
+  static void Init();
+  
+  // Queues the object for writing. A request for the same object which is
+  // still waiting will save its latest content and size, so it is not queued
+  // twice. Returns false, rather than waiting for the interrupt, if the queue
+  // is full.
+  static bool Write(const void* data, uint8_t* address, uint16_t size);
+  
+  // Called by the EE_READY interrupt.
+  static void WriteNextByte();
+  
+  static inline bool busy() { return read_ptr_ != write_ptr_; }
+  
+  // True if a request for this address is waiting to be started.
+  static bool queued(const uint8_t* address);
+  
+ private:
+  // Must be called with the interrupts disabled.
+  static EepromWriteRequest* Find(const uint8_t* address);
+  
+  static EepromWriteRequest requests_[kEepromWriterQueueSize];
+  static volatile uint8_t read_ptr_;
+  static volatile uint8_t write_ptr_;
+  
+  // Progress in the object being written.
+  static uint16_t position_;
+  static uint8_t checksum_;
+  
+  DISALLOW_COPY_AND_ASSIGN(EepromWriter);
+};
+
+extern EepromWriter eeprom_writer;
+
+}  // namespace anu
+
+#endif  // ANU_EEPROM_WRITER_H_
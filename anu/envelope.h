@@ -51,6 +51,11 @@ class Envelope {
     return static_cast<EnvelopeSegment>(segment_);
   }
   
+  // True when the envelope holds its value (sustain or dead segment).
+  inline bool steady() const {
+    return segment_ == ENV_SEGMENT_SUSTAIN || segment_ == ENV_SEGMENT_DEAD;
+  }
+  
   inline uint8_t gate() const {
     return segment_ < ENV_SEGMENT_RELEASE ? 255 : 0;
   }
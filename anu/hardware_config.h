@@ -37,8 +37,6 @@ using avrlib::PortB;
 using avrlib::PortC;
 using avrlib::PortD;
 using avrlib::PwmChannel1B;
-using avrlib::RingBuffer;
-using avrlib::SerialInput;
 using avrlib::SerialPort0;
 using avrlib::ShiftRegisterOutput;
 using avrlib::SpiMaster;
@@ -51,7 +49,6 @@ typedef avrlib::Serial<
     31250,
     avrlib::POLLED,
     avrlib::POLLED> MidiIO;
-typedef RingBuffer<SerialInput<SerialPort0> > MidiBuffer;
 
 // IO
 typedef Gpio<PortD, 6> IOClockLine;
@@ -0,0 +1,103 @@
+# Copyright 2012 Emilie Gillet.
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# -----------------------------------------------------------------------------
+#
+# Host-native build of the DSP and control core, for profiling and regression
+# testing on a workstation. The hardware-specific parts of avrlib and avr-libc
+# are replaced by the shims in anu/host.
+#
+# make -f anu/host.mk        builds the static library, the test binary, and
+#                            the offline renderer (anu_render).
+# make -f anu/host.mk test   runs the tests, and checks that the outputs of the
+#                            golden scenarios are bit-exact (anu_golden).
+# make -f anu/host.mk golden records the outputs of the golden scenarios, when
+#                            a change in the outputs is intended.
+#
+# The golden outputs are those of the default buffer profile. With another
+# profile (BUFFER_PROFILE=..., see anu/buffer_profile.mk), only the tests are
+# run.
+
+include anu/buffer_profile.mk
+
+TARGET         = anu_host$(BUFFER_PROFILE_SUFFIX)
+BUILD_ROOT     = build/
+BUILD_DIR      = $(BUILD_ROOT)$(TARGET)/
+
+CORE_SOURCES   = audio_buffer clock drum_synth eeprom_writer lfo \
+                 midi_dispatcher midi_out_queue parameter performance_counters \
+                 program_storage resources sequence sysex_handler \
+                 system_settings voice voice_controller
+SHIM_SOURCES   = host
+TOOL_SOURCES   = midi_file simulator wav_writer
+TEST_SOURCES   = anu_test
+RENDER_SOURCES = render
+GOLDEN_SOURCES = golden
+GOLDEN_FILE    = anu/host/golden.txt
+
+CXX            = g++
+AR             = ar
+CXXFLAGS       = -O2 -g -Wall -Wno-unused-variable -Wno-return-type \
+                 -Wno-narrowing -Wno-switch -Wno-maybe-uninitialized \
+                 -fno-strict-aliasing $(BUFFER_PROFILE_DEFINES) \
+                 -Ianu/host -I. -MMD
+
+CORE_OBJS      = $(patsubst %,$(BUILD_DIR)%.o,$(CORE_SOURCES) $(SHIM_SOURCES) \
+                 $(TOOL_SOURCES))
+TEST_OBJS      = $(patsubst %,$(BUILD_DIR)%.o,$(TEST_SOURCES))
+RENDER_OBJS    = $(patsubst %,$(BUILD_DIR)%.o,$(RENDER_SOURCES))
+GOLDEN_OBJS    = $(patsubst %,$(BUILD_DIR)%.o,$(GOLDEN_SOURCES))
+
+TARGET_LIB     = $(BUILD_DIR)libanu.a
+TARGET_TEST    = $(BUILD_DIR)anu_test
+TARGET_RENDER  = $(BUILD_DIR)anu_render
+TARGET_GOLDEN  = $(BUILD_DIR)anu_golden
+
+VPATH          = anu anu/host
+
+all: $(TARGET_LIB) $(TARGET_TEST) $(TARGET_RENDER) $(TARGET_GOLDEN)
+
+$(BUILD_DIR):
+	mkdir -p $(BUILD_DIR)
+
+$(BUILD_DIR)%.o: %.cc | $(BUILD_DIR)
+	$(CXX) $(CXXFLAGS) -c $< -o $@
+
+$(TARGET_LIB): $(CORE_OBJS)
+	$(AR) rcs $@ $^
+
+$(TARGET_TEST): $(TEST_OBJS) $(TARGET_LIB)
+	$(CXX) $(CXXFLAGS) $^ -o $@
+
+$(TARGET_RENDER): $(RENDER_OBJS) $(TARGET_LIB)
+	$(CXX) $(CXXFLAGS) $^ -o $@
+
+$(TARGET_GOLDEN): $(GOLDEN_OBJS) $(TARGET_LIB)
+	$(CXX) $(CXXFLAGS) $^ -o $@
+
+test: $(TARGET_TEST) $(TARGET_GOLDEN)
+	$(TARGET_TEST)
+ifeq ($(BUFFER_PROFILE),)
+	$(TARGET_GOLDEN) $(GOLDEN_FILE)
+endif
+
+golden: $(TARGET_GOLDEN)
+	$(TARGET_GOLDEN) --record $(GOLDEN_FILE)
+
+clean:
+	rm -rf $(BUILD_DIR)
+
+.PHONY: all test golden clean
+
+-include $(CORE_OBJS:.o=.d) $(TEST_OBJS:.o=.d) $(RENDER_OBJS:.o=.d) \
+         $(GOLDEN_OBJS:.o=.d)
@@ -0,0 +1,1170 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host tests for the DSP and control core.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+
+#include "avrlib/random.h"
+#include "avrlib/time.h"
+
+#include "anu/audio_buffer.h"
+#include "anu/clock.h"
+#include "anu/drum_synth.h"
+#include "anu/eeprom_writer.h"
+#include "anu/envelope.h"
+#include "anu/lfo.h"
+#include "anu/midi_dispatcher.h"
+#include "anu/midi_out_queue.h"
+#include "anu/note_stack.h"
+#include "anu/performance_counters.h"
+#include "anu/program_storage.h"
+#include "anu/sequence.h"
+#include "anu/storage.h"
+#include "anu/sysex_handler.h"
+#include "anu/system_settings.h"
+#include "anu/voice.h"
+#include "anu/voice_controller.h"
+
+using namespace anu;
+
+static int num_failures = 0;
+
+#define EXPECT(condition) \
+  if (!(condition)) { \
+    fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #condition); \
+    ++num_failures; \
+  }
+
+static void Reset() {
+  host_eeprom_erase();
+  avrlib::ResetSystemClock();
+  avrlib::Random::Seed(0x21);
+  audio_buffer.Init();
+  eeprom_writer.Init();
+  program_storage.Init();
+  midi_out_queue.Init();
+  system_settings.Init();
+  drum_synth.Init();
+  voice_controller.Init();
+}
+
+static void TestNoteStack() {
+  NoteStack<4> stack;
+  stack.Init();
+  stack.NoteOn(60, 100);
+  stack.NoteOn(48, 90);
+  stack.NoteOn(72, 80);
+  EXPECT(stack.size() == 3);
+  EXPECT(stack.most_recent_note().note == 72);
+  EXPECT(stack.least_recent_note().note == 60);
+  EXPECT(stack.sorted_note(0).note == 48);
+  EXPECT(stack.sorted_note(1).note == 60);
+  EXPECT(stack.sorted_note(2).note == 72);
+  EXPECT(stack.played_note(0).note == 60);
+  EXPECT(stack.played_note(2).note == 72);
+
+  // Retriggering a note moves it to the top of the stack.
+  stack.NoteOn(60, 110);
+  EXPECT(stack.size() == 3);
+  EXPECT(stack.most_recent_note().note == 60);
+  EXPECT(stack.most_recent_note().velocity == 110);
+
+  // Saturation evicts the least recently played note.
+  stack.NoteOn(50, 1);
+  stack.NoteOn(52, 1);
+  EXPECT(stack.size() == 4);
+  EXPECT(stack.least_recent_note().note == 72);
+  EXPECT(stack.sorted_note(0).note == 50);
+
+  stack.NoteOff(52);
+  stack.NoteOff(50);
+  EXPECT(stack.most_recent_note().note == 60);
+  stack.Clear();
+  EXPECT(stack.size() == 0);
+  
+  // Random note ons and offs, checked against an array of the notes from
+  // the least recent to the most recent.
+  uint8_t played[4];
+  uint8_t num_played = 0;
+  bool consistent = true;
+  uint16_t random = 1;
+  for (uint16_t i = 0; i < 2000; ++i) {
+    random = random * 25173 + 13849;
+    uint8_t note = 40 + ((random >> 8) & 0x0f);
+    bool note_on = random & 0x1000;
+    uint8_t j = 0;
+    while (j < num_played && played[j] != note) {
+      ++j;
+    }
+    if (j < num_played) {
+      memmove(played + j, played + j + 1, num_played - j - 1);
+      --num_played;
+    }
+    if (note_on) {
+      if (num_played == 4) {
+        memmove(played, played + 1, 3);
+        --num_played;
+      }
+      played[num_played++] = note;
+      stack.NoteOn(note, 100);
+    } else {
+      stack.NoteOff(note);
+    }
+    consistent = consistent && stack.size() == num_played;
+    for (uint8_t k = 0; k < num_played; ++k) {
+      consistent = consistent && stack.played_note(k).note == played[k];
+      consistent = consistent && (k == 0 ||
+          stack.sorted_note(k - 1).note < stack.sorted_note(k).note);
+    }
+  }
+  EXPECT(consistent);
+}
+
+static void TestEnvelope() {
+  Envelope envelope;
+  envelope.Init();
+  envelope.Update(20, 40, 128, 40);
+  envelope.Trigger(ENV_SEGMENT_ATTACK);
+  EXPECT(envelope.gate());
+  uint16_t peak = 0;
+  for (uint16_t i = 0; i < 2000; ++i) {
+    uint16_t value = envelope.Render();
+    if (value > peak) {
+      peak = value;
+    }
+  }
+  EXPECT(peak > 60000);
+  EXPECT(envelope.segment() == ENV_SEGMENT_SUSTAIN);
+  EXPECT(envelope.value() >> 8 == 128);
+  envelope.Trigger(ENV_SEGMENT_RELEASE);
+  EXPECT(!envelope.gate());
+  for (uint16_t i = 0; i < 20000; ++i) {
+    envelope.Render();
+  }
+  EXPECT(envelope.segment() == ENV_SEGMENT_DEAD);
+  EXPECT(envelope.value() == 0);
+}
+
+static void TestInterpolatedCv() {
+  InterpolatedCv cv;
+  cv.Init();
+  // The target is reached exactly at the end of the ramp, whatever the
+  // rounding of the increment, and held.
+  cv.Start(1003, 2);
+  uint16_t previous = cv.Next();
+  for (uint8_t i = 1; i < 4; ++i) {
+    uint16_t value = cv.Next();
+    EXPECT(value > previous);
+    previous = value;
+  }
+  EXPECT(previous == 1003);
+  EXPECT(cv.Next() == 1003);
+  cv.Start(1003, 2);
+  for (uint8_t i = 0; i < 4; ++i) {
+    EXPECT(cv.Next() == 1003);
+  }
+  // Downwards ramps do not overshoot.
+  cv.Start(998, 2);
+  for (uint8_t i = 0; i < 4; ++i) {
+    EXPECT(cv.Next() >= 998);
+  }
+  EXPECT(cv.Next() == 998);
+}
+
+static void TestLfo() {
+  static Lfo lfo;
+  lfo.set_phase(0);
+  lfo.set_phase_increment(1UL << 24);
+  for (uint8_t shape = 0; shape < LFO_SHAPE_LAST; ++shape) {
+    lfo.set_shape(static_cast<LfoShape>(shape));
+    uint16_t minimum = 0xffff;
+    uint16_t maximum = 0;
+    for (uint16_t i = 0; i < 1024; ++i) {
+      uint16_t value = lfo.Render();
+      if (value < minimum) minimum = value;
+      if (value > maximum) maximum = value;
+    }
+    EXPECT(maximum - minimum > 32768);
+  }
+
+  lfo.set_shape(LFO_SHAPE_RAMP_UP);
+  lfo.set_phase(0);
+  uint16_t previous = lfo.Render();
+  for (uint8_t i = 0; i < 255; ++i) {
+    uint16_t value = lfo.Render();
+    EXPECT(value > previous);
+    previous = value;
+  }
+}
+
+static void TestClock() {
+  clock.Update(120, 1, 0, 1);
+  clock.Reset();
+  // 120 BPM at 24 ppqn: 48 ticks per second, so 48 events for one second of
+  // the 39kHz timer.
+  uint8_t num_events = 0;
+  for (uint16_t i = 0; i < 39216; ++i) {
+    clock.Tick();
+    num_events += clock.CountEvents();
+  }
+  EXPECT(num_events == 48);
+}
+
+static void TestDrumSynth() {
+  Reset();
+  drum_synth.Render();
+  EXPECT(!drum_synth.playing());
+  EXPECT(!audio_buffer.writable());
+  // Skip the block played by the audio interrupt after initialization.
+  for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
+    audio_buffer.ImmediateRead();
+  }
+  uint8_t num_non_silent = 0;
+  for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
+    num_non_silent += audio_buffer.ImmediateRead() != 128;
+  }
+  EXPECT(num_non_silent == 0);
+  EXPECT(audio_buffer.writable() == 1);
+
+  drum_synth.Trigger(0, 255);
+  EXPECT(drum_synth.playing());
+  uint8_t minimum = 255;
+  uint8_t maximum = 0;
+  for (uint8_t block = 0; block < 32; ++block) {
+    drum_synth.Render();
+    for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
+      uint8_t sample = audio_buffer.ImmediateRead();
+      if (sample < minimum) minimum = sample;
+      if (sample > maximum) maximum = sample;
+    }
+  }
+  EXPECT(maximum - minimum > 128);
+}
+
+// Returns the number of samples between the reception of a scheduled trigger,
+// delayed by the given number of samples, and the first non-silent sample.
+static uint16_t MeasureDrumTriggerLatency(uint8_t delay) {
+  Reset();
+  // Skip the block played by the audio interrupt after initialization.
+  drum_synth.Render();
+  for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
+    audio_buffer.ImmediateRead();
+  }
+  for (uint16_t i = 0; i < delay + 4 * kAudioBlockSize; ++i) {
+    drum_synth.Render();
+    if (i == delay) {
+      drum_synth.Trigger(2, 255, audio_buffer.read_position());
+    }
+    if (i >= delay && audio_buffer.ImmediateRead() != 128) {
+      return i - delay;
+    }
+  }
+  return 0;
+}
+
+// Renders a snare roll, with an optional silent hi-hat trigger scheduled in
+// the middle of a slice, and returns a checksum of the output.
+static uint32_t RenderSnareWithSplitSlice(bool split) {
+  Reset();
+  drum_synth.MorphPatch(1, 255);
+  drum_synth.Trigger(1, 255);
+  uint32_t checksum = 0;
+  for (uint8_t block = 0; block < 16; ++block) {
+    if (split && block == 4) {
+      drum_synth.Trigger(2, 0, audio_buffer.read_position() + 5);
+    }
+    drum_synth.Render();
+    for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
+      checksum = checksum * 31 + audio_buffer.ImmediateRead();
+    }
+  }
+  return checksum;
+}
+
+static void TestScheduledDrumTrigger() {
+  // Splitting a slice at a scheduled trigger does not alter the noise of the
+  // voices already playing.
+  EXPECT(RenderSnareWithSplitSlice(true) == RenderSnareWithSplitSlice(false));
+  
+  
+  // The latency is constant, whatever the position of the reception within
+  // a block or a control period.
+  uint16_t latency = MeasureDrumTriggerLatency(0);
+  EXPECT(latency >= kNumAudioBlocks * kAudioBlockSize);
+  for (uint8_t delay = 1; delay < 2 * kAudioBlockSize; delay += 7) {
+    EXPECT(MeasureDrumTriggerLatency(delay) == latency);
+  }
+  
+  // A trigger whose position has already been passed by more than the latency
+  // is played in the next block, even when the distance wraps around.
+  Reset();
+  drum_synth.Render();
+  for (uint8_t i = 0; i < kAudioBlockSize; ++i) {
+    audio_buffer.ImmediateRead();
+  }
+  drum_synth.Trigger(2, 255, audio_buffer.write_position() - 255);
+  drum_synth.Render();
+  uint8_t num_non_silent = 0;
+  for (uint8_t i = 0; i < 2 * kAudioBlockSize; ++i) {
+    num_non_silent += audio_buffer.ImmediateRead() != 128;
+  }
+  EXPECT(num_non_silent > 0);
+}
+
+static void TestVoiceController() {
+  Reset();
+  Voice* voice = voice_controller.mutable_voice();
+  voice->Refresh();
+  EXPECT(voice->at_rest());
+
+  voice_controller.NoteOn(72, 100);
+  EXPECT(voice->gate());
+  uint16_t vca_cv = 0;
+  for (uint16_t i = 0; i < 1000; ++i) {
+    voice->ReadDACStateSample();
+    voice->Refresh();
+    if (voice->dac_state().vca_cv > vca_cv) {
+      vca_cv = voice->dac_state().vca_cv;
+    }
+  }
+  EXPECT(vca_cv > 2048);
+  uint16_t high_vco_cv = voice->dac_state().vco_cv;
+
+  voice_controller.NoteOn(48, 100);
+  voice_controller.NoteOff(48);
+  EXPECT(voice->gate());
+  voice_controller.NoteOff(72);
+  EXPECT(!voice->gate());
+  for (uint16_t i = 0; i < 1000; ++i) {
+    voice->ReadDACStateSample();
+    voice->Refresh();
+  }
+  EXPECT(voice->dac_state().vco_cv == high_vco_cv);
+
+  // Only the channels which are modulated are sent to the DACs. The PW is
+  // modulated by the LFO in the default patch, but not the VCO.
+  voice->TakeDACStateChanges();
+  voice->ReadDACStateSample();
+  voice->Refresh();
+  uint8_t changes = voice->TakeDACStateChanges();
+  EXPECT(changes & DAC_CHANNEL_PW);
+  EXPECT(!(changes & DAC_CHANNEL_VCO));
+
+  // Patch changes are picked by the next DAC state samples.
+  voice->SetValue(PRM_PATCH_VCO_DCO_RANGE, 1);
+  for (uint8_t i = 0; i < kDACStateBufferSize; ++i) {
+    voice->ReadDACStateSample();
+    voice->Refresh();
+  }
+  EXPECT(voice->dac_state().vco_cv > high_vco_cv);
+  
+  // Scheduled note ons are played kDACStateBufferSize DAC state samples after
+  // the one played when they were received, even though some of the samples
+  // in between have already been computed.
+  voice_controller.AllSoundOff();
+  for (uint16_t i = 0; i < 1000; ++i) {
+    voice->ReadDACStateSample();
+    voice->Refresh();
+  }
+  voice->ScheduleNoteOn(60, 100, 0, 0, false, voice->dac_timestamp());
+  EXPECT(!voice->gate());
+  uint8_t latency = 0;
+  while (!voice->dac_state().vca_cv && latency < 16) {
+    voice->ReadDACStateSample();
+    voice->Refresh();
+    ++latency;
+  }
+  EXPECT(latency == kDACStateBufferSize);
+}
+
+static void TestPerformanceCounters() {
+  Reset();
+  performance_counters.Init();
+  performance_counters.set_main_loop_busy(true);
+  for (uint16_t i = 0; i < kLoadWindowSize; ++i) {
+    performance_counters.Sample();
+  }
+  EXPECT(performance_counters.data().cpu_load == 255);
+  for (uint16_t i = 0; i < kLoadWindowSize; ++i) {
+    performance_counters.set_main_loop_busy(i & 1);
+    performance_counters.Sample();
+  }
+  EXPECT(performance_counters.data().cpu_load == 128);
+  EXPECT(performance_counters.data().peak_cpu_load == 255);
+  performance_counters.CountAudioUnderrun();
+  performance_counters.CountDACUnderrun();
+  performance_counters.CountDACUnderrun();
+
+  // Request a dump of the counters, and reset them.
+  uint8_t byte;
+  while (midi_dispatcher.ReadOutput(&byte));
+  static const uint8_t request[] = {
+    0xf0, 0x00, 0x21, 0x02, 0x00, 0x08, 0x12, 0x01, 0x00, 0x00, 0xf7
+  };
+  for (uint8_t i = 0; i < sizeof(request); ++i) {
+    sysex_handler.Receive(request[i]);
+  }
+  uint8_t reply[64];
+  uint8_t size = 0;
+  while (size < sizeof(reply)) {
+    sysex_handler.Refresh();
+    if (!midi_dispatcher.ReadOutput(&byte)) {
+      break;
+    }
+    reply[size++] = byte;
+  }
+  EXPECT(size == 6 + 2 + 2 * sizeof(PerformanceCountersData) + 2 + 1);
+  EXPECT(reply[6] == 0x02);
+  EXPECT(reply[8] == 0x08 && reply[9] == 0x00);  // cpu_load.
+  EXPECT(reply[10] == 0x0f && reply[11] == 0x0f);  // peak_cpu_load.
+  EXPECT(reply[13] == 0x01);  // audio_underruns.
+  EXPECT(reply[17] == 0x02);  // dac_underruns.
+  EXPECT(reply[size - 1] == 0xf7);
+  EXPECT(performance_counters.data().peak_cpu_load == 0);
+  EXPECT(performance_counters.data().dac_underruns == 0);
+}
+
+static void TestMidiOutRunningStatus() {
+  Reset();
+  system_settings.set_midi_out_mode(
+      MIDI_OUT_TX_GENERATED_DRUM_MESSAGES | MIDI_OUT_TX_TRANSPORT);
+  uint8_t byte;
+  while (midi_dispatcher.ReadOutput(&byte));
+  
+  // The drum note offs are sent as note ons with a velocity of 0, and the
+  // status is sent only once, even with a realtime message interleaved. A
+  // system message cancels the running status.
+  midi_dispatcher.OnDrumNote(36, 100);
+  midi_dispatcher.OnDrumNote(38, 90);
+  midi_out_queue.SendSystem(0xf0);
+  midi_out_queue.SendSystem(0xf7);
+  midi_dispatcher.OnDrumNote(42, 80);
+  static const uint8_t expected[] = {
+    0x99, 36, 100, 0xf8, 36, 0, 38, 90, 38, 0, 0xf0, 0xf7, 0x99, 42, 80, 42, 0
+  };
+  uint8_t size = 0;
+  bool match = true;
+  while (midi_dispatcher.ReadOutput(&byte)) {
+    match = match && size < sizeof(expected) && byte == expected[size];
+    ++size;
+    if (size == 3) {
+      midi_dispatcher.OnClock(false);
+    }
+  }
+  EXPECT(match);
+  EXPECT(size == sizeof(expected));
+}
+
+static void TestMidiOutQueue() {
+  Reset();
+  performance_counters.Init();
+  
+  // Control changes for the same controller are coalesced.
+  midi_out_queue.Send3(0xb0, 7, 10);
+  midi_out_queue.Send3(0xb0, 7, 20);
+  uint8_t byte;
+  uint8_t bytes[3];
+  uint8_t size = 0;
+  while (midi_out_queue.ReadByte(&byte) && size < 3) {
+    bytes[size++] = byte;
+  }
+  EXPECT(size == 3 && bytes[2] == 20);
+  
+  // The (N)RPN and data entry controllers are sent in order.
+  static const uint8_t nrpn[] = {
+    99, 1, 98, 2, 6, 10, 99, 1, 98, 3, 6, 20
+  };
+  for (uint8_t i = 0; i < sizeof(nrpn); i += 2) {
+    midi_out_queue.Send3(0xb0, nrpn[i], nrpn[i + 1]);
+  }
+  bool match = true;
+  size = 0;
+  while (midi_out_queue.ReadByte(&byte)) {
+    match = match && (size % 3 ? byte == nrpn[size / 3 * 2 + size % 3 - 1] :
+        byte == 0xb0);
+    ++size;
+  }
+  EXPECT(match);
+  EXPECT(size == sizeof(nrpn) / 2 * 3);
+  
+  // When the queue is full, new messages are dropped whole, and the last
+  // entries are kept for the note offs and system exclusive data.
+  uint8_t num_messages = 0;
+  for (uint8_t i = 0; i < kMidiOutQueueSize; ++i) {
+    midi_out_queue.Send3(0x90, 60 + i, 100);
+  }
+  uint8_t num_drops = kMidiOutQueueReserve + 1;
+  EXPECT(performance_counters.data().midi_out_drops == num_drops);
+  for (uint8_t i = 0; i < kMidiOutQueueSize; ++i) {
+    midi_out_queue.Send3(0x90, 60 + i, 0);
+  }
+  midi_out_queue.SendSystem(0xf0);
+  num_drops += kMidiOutQueueSize - kMidiOutQueueReserve + 1;
+  EXPECT(performance_counters.data().midi_out_drops == num_drops);
+  bool intact = true;
+  size = 0;
+  while (midi_out_queue.ReadByte(&byte)) {
+    intact = intact && (size % 3 == 0) == (byte == 0x90);
+    num_messages += byte == 0x90;
+    ++size;
+  }
+  EXPECT(intact);
+  EXPECT(size == 3 * (kMidiOutQueueSize - 1));
+  EXPECT(num_messages == kMidiOutQueueSize - 1);
+}
+
+static bool ExpectMidiOutput(const uint8_t* expected, uint8_t size) {
+  uint8_t byte;
+  uint8_t num_bytes = 0;
+  bool match = true;
+  while (midi_dispatcher.ReadOutput(&byte)) {
+    match = match && num_bytes < size && byte == expected[num_bytes];
+    ++num_bytes;
+  }
+  return match && num_bytes == size;
+}
+
+static void TestMidiThru() {
+  Reset();
+  system_settings.set_midi_out_mode(MIDI_OUT_TX_INPUT_MESSAGES);
+  midi::MidiStreamParser<MidiDispatcher> parser;
+  uint8_t byte;
+  while (midi_dispatcher.ReadOutput(&byte));
+  
+  // The realtime messages are sent at once, even within another message,
+  // and so are the other system messages without data.
+  static const uint8_t input[] = { 0xf8, 0xf8, 0xb0, 7, 0xf8, 64, 0xf6 };
+  static const uint8_t output[] = { 0xf8, 0xf8, 0xf8, 0xb0, 7, 64, 0xf6 };
+  for (uint8_t i = 0; i < 2; ++i) {
+    parser.PushByte(input[i]);
+  }
+  EXPECT(ExpectMidiOutput(output, 2));
+  for (uint8_t i = 2; i < sizeof(input); ++i) {
+    parser.PushByte(input[i]);
+  }
+  EXPECT(ExpectMidiOutput(output + 2, sizeof(output) - 2));
+}
+
+static void TestBulkDump() {
+  Reset();
+  performance_counters.Init();
+  system_settings.set_midi_out_mode(MIDI_OUT_TX_GENERATED_MESSAGES);
+  uint8_t byte;
+  while (midi_dispatcher.ReadOutput(&byte));
+  
+  // The dump does not block: it only fills the output queue up to its
+  // reserve, and is streamed as the queue empties.
+  sysex_handler.BulkDump(false);
+  sysex_handler.Refresh();
+  EXPECT(midi_out_queue.writable() == kMidiOutQueueReserve);
+  
+  // The notes played during the dump do not corrupt it: the note offs are
+  // sent after the end of the current block, the note ons are dropped.
+  midi_dispatcher.OnInternalNoteOn(60, 100);
+  midi_dispatcher.OnInternalNoteOff(60);
+  EXPECT(performance_counters.data().midi_out_drops == 1);
+  
+  uint16_t size = 0;
+  uint8_t num_blocks = 0;
+  bool in_block = false;
+  bool intact = true;
+  uint16_t note_off_position = 0;
+  while (true) {
+    sysex_handler.Refresh();
+    if (!midi_dispatcher.ReadOutput(&byte)) {
+      break;
+    }
+    if (byte == 0xf0) {
+      intact = intact && !in_block;
+      in_block = true;
+    } else if (byte == 0xf7) {
+      intact = intact && in_block;
+      in_block = false;
+      ++num_blocks;
+    } else if (byte == 0x90) {
+      intact = intact && !in_block;
+      note_off_position = size;
+    } else {
+      intact = intact && (!in_block || byte < 0x80);
+    }
+    ++size;
+  }
+  // Header, command, checksum and footer of each block, then the data, then
+  // the note off. The unpacked sequence objects are not sent.
+  uint8_t num_objects = SYSEX_OBJECT_TYPE_LAST - 2;
+  uint16_t expected_size = num_objects * (6 + 2 + 2 + 1);
+  expected_size += 2 * (sizeof(SystemSettingsData) + sizeof(Patch) + \
+      sizeof(SequencerSettings) + sizeof(Sequence));
+  expected_size += 3;
+  EXPECT(intact);
+  EXPECT(num_blocks == num_objects);
+  EXPECT(size == expected_size);
+  EXPECT(note_off_position > 0);
+}
+
+static void TestPackedSysEx() {
+  Reset();
+  uint8_t byte;
+  while (midi_dispatcher.ReadOutput(&byte));
+  
+  // Request a packed dump.
+  static const uint8_t request[] = {
+    0xf0, 0x00, 0x21, 0x02, 0x00, 0x08, 0x31, 0x00, 0x00, 0x00, 0xf7
+  };
+  for (uint8_t i = 0; i < sizeof(request); ++i) {
+    sysex_handler.Receive(request[i]);
+  }
+  static uint8_t dump[1024];
+  uint16_t size = 0;
+  while (size < sizeof(dump)) {
+    sysex_handler.Refresh();
+    if (!midi_dispatcher.ReadOutput(&byte)) {
+      break;
+    }
+    dump[size++] = byte;
+  }
+  uint16_t expected_size = 0;
+  static const uint8_t sizes[] = {
+    sizeof(SystemSettingsData),
+    sizeof(Patch),
+    sizeof(SequencerSettings),
+    128,
+    sizeof(Sequence) - 128
+  };
+  for (uint8_t i = 0; i < sizeof(sizes); ++i) {
+    expected_size += 6 + 2 + sizes[i] + 1 + (sizes[i] + 7) / 7 + 1;
+  }
+  EXPECT(size == expected_size);
+  EXPECT(dump[6] == 0x21);
+  
+  // Restore the dump after having changed the patch.
+  Patch* patch = voice_controller.mutable_voice()->mutable_patch();
+  Patch original = *patch;
+  memset(patch, 0xff, sizeof(Patch));
+  for (uint16_t i = 0; i < size; ++i) {
+    sysex_handler.Receive(dump[i]);
+  }
+  EXPECT(!memcmp(patch, &original, sizeof(Patch)));
+}
+
+static void SendSysExObject(
+    uint8_t type,
+    const uint8_t* data,
+    uint8_t size) {
+  static const uint8_t header[] = {
+    0xf0, 0x00, 0x21, 0x02, 0x00, 0x08, 0x01
+  };
+  for (uint8_t i = 0; i < sizeof(header); ++i) {
+    sysex_handler.Receive(header[i]);
+  }
+  sysex_handler.Receive(type);
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < size; ++i) {
+    sysex_handler.Receive(data[i] >> 4);
+    sysex_handler.Receive(data[i] & 0xf);
+    checksum += data[i];
+  }
+  sysex_handler.Receive(checksum >> 4);
+  sysex_handler.Receive(checksum & 0xf);
+  sysex_handler.Receive(0xf7);
+}
+
+static void TestLegacySequenceSysEx() {
+  Reset();
+  Sequence* sequence = voice_controller.mutable_sequence();
+  Sequence original = *sequence;
+  
+  // A sequence of 128 steps in the unpacked format of the previous versions
+  // of the firmware, with a rest, a tie and a leap.
+  uint8_t legacy[1 + kLegacySequenceLength + 2 * kLegacySequenceFlagsSize];
+  memset(legacy, 0, sizeof(legacy));
+  uint8_t* notes = legacy + 1;
+  uint8_t* accents = notes + kLegacySequenceLength;
+  uint8_t* slides = accents + kLegacySequenceFlagsSize;
+  legacy[0] = kLegacySequenceLength;
+  for (uint8_t i = 0; i < kLegacySequenceLength; ++i) {
+    notes[i] = 48 + (i & 7);
+  }
+  notes[1] = kSequenceRest;
+  notes[2] = kSequenceTie;
+  notes[3] = 100;
+  accents[0] = 0x09;
+  slides[0] = 0x08;
+  accents[15] = 0x80;
+  slides[15] = 0x80;
+  
+  // The second block alone, or an unknown object, is ignored.
+  SendSysExObject(0x04, legacy + 128, sizeof(legacy) - 128);
+  SendSysExObject(0x07, legacy, 1);
+  EXPECT(!memcmp(sequence, &original, sizeof(Sequence)));
+  
+  // The sequence is converted, and played from its first step.
+  voice_controller.Start();
+  for (uint8_t i = 0; i < 24 && !voice_controller.sequencer_step(); ++i) {
+    voice_controller.Clock(true);
+  }
+  EXPECT(voice_controller.sequencer_step() != 0);
+  SendSysExObject(0x03, legacy, 128);
+  SendSysExObject(0x04, legacy + 128, sizeof(legacy) - 128);
+  EXPECT(voice_controller.sequencer_step() == 0);
+  EXPECT(sequence->num_notes == kLegacySequenceLength);
+  SequenceReader reader;
+  reader.Init(sequence);
+  for (uint8_t i = 0; i < kLegacySequenceLength; ++i) {
+    SequenceStep step = reader.Next();
+    uint8_t flags = 0;
+    if (accents[i >> 3] & (1 << (i & 7))) {
+      flags |= SEQUENCE_FLAG_ACCENT;
+    }
+    if (slides[i >> 3] & (1 << (i & 7))) {
+      flags |= SEQUENCE_FLAG_SLIDE;
+    }
+    EXPECT(step.note == notes[i]);
+    EXPECT(step.flags == (notes[i] < 0x80 ? flags : 0));
+  }
+}
+
+static void TestSysExThru() {
+  Reset();
+  performance_counters.Init();
+  system_settings.set_midi_out_mode(MIDI_OUT_TX_INPUT_MESSAGES);
+  midi::MidiStreamParser<MidiDispatcher> parser;
+  uint8_t byte;
+  while (midi_dispatcher.ReadOutput(&byte));
+  
+  // A system exclusive message received during a block of the dump is
+  // dropped whole, rather than interleaved with it.
+  static const uint8_t input[] = { 0xf0, 0x7d, 0x01, 0x02, 0xf7 };
+  sysex_handler.BulkDump(true);
+  sysex_handler.Refresh();
+  for (uint8_t i = 0; i < sizeof(input); ++i) {
+    parser.PushByte(input[i]);
+  }
+  EXPECT(performance_counters.data().midi_out_drops == 1);
+  uint8_t num_blocks = 0;
+  uint8_t position = 0;
+  bool intact = true;
+  while (true) {
+    sysex_handler.Refresh();
+    if (!midi_dispatcher.ReadOutput(&byte)) {
+      break;
+    }
+    if (byte == 0xf0) {
+      intact = intact && !position;
+      position = 0;
+    } else if (position == 1) {
+      intact = intact && byte == 0x00;
+    }
+    ++position;
+    if (byte == 0xf7) {
+      position = 0;
+      ++num_blocks;
+    }
+  }
+  EXPECT(intact);
+  EXPECT(num_blocks == SYSEX_OBJECT_TYPE_LAST - 2);
+  
+  // Once the dump is done, the messages are forwarded.
+  for (uint8_t i = 0; i < sizeof(input); ++i) {
+    parser.PushByte(input[i]);
+  }
+  EXPECT(ExpectMidiOutput(input, sizeof(input)));
+}
+
+static uint32_t RunEepromWriter() {
+  uint32_t num_interrupts = 0;
+  while (EECR & _BV(EERIE)) {
+    eeprom_writer.WriteNextByte();
+    ++num_interrupts;
+  }
+  return num_interrupts;
+}
+
+static void TestEepromWriter() {
+  Reset();
+  RunEepromWriter();
+  uint8_t* address = (uint8_t*)(960);
+  uint8_t data[32];
+  for (uint8_t i = 0; i < sizeof(data); ++i) {
+    data[i] = i;
+  }
+  
+  // The save returns immediately, and the data is written by the interrupt.
+  uint32_t num_writes = host_eeprom_num_writes;
+  storage.Save(data, address, sizeof(data));
+  storage.Save(data, address, sizeof(data));
+  EXPECT(eeprom_writer.busy());
+  EXPECT(host_eeprom_num_writes == num_writes);
+  RunEepromWriter();
+  EXPECT(!eeprom_writer.busy());
+  EXPECT(host_eeprom_num_writes - num_writes == sizeof(data) + 1);
+  
+  // Only the bytes which have changed are written.
+  num_writes = host_eeprom_num_writes;
+  data[3] = 100;
+  data[20] = 200;
+  storage.Save(data, address, sizeof(data));
+  RunEepromWriter();
+  EXPECT(host_eeprom_num_writes - num_writes == 3);
+  
+  uint8_t loaded[32];
+  storage.Load(loaded, address, sizeof(loaded), NULL, false);
+  EXPECT(!memcmp(loaded, data, sizeof(data)));
+  
+  // When the queue is full, a save fails rather than waiting for the
+  // interrupt. The requests which are still waiting can be updated.
+  for (uint8_t i = 0; i < kEepromWriterQueueSize - 1; ++i) {
+    EXPECT(storage.Save(data, address + i * 8, 4));
+  }
+  EXPECT(!storage.Save(data, address + 56, 4));
+  EXPECT(storage.Save(data, address + 8, 8));
+  RunEepromWriter();
+  EXPECT(storage.Save(data, address + 56, 4));
+  RunEepromWriter();
+  
+  // A sequence which does not fit in the queue is saved by the main loop.
+  for (uint8_t i = 0; i < kEepromWriterQueueSize - 1; ++i) {
+    data[0] = i;
+    storage.Save(data, address + i * 8, 4);
+  }
+  Sequence* sequence = voice_controller.mutable_sequence();
+  sequence->num_notes = 0;
+  sequence->size = 0;
+  voice_controller.SaveSequence();
+  EXPECT(!eeprom_writer.queued((uint8_t*)(256)));
+  RunEepromWriter();
+  voice_controller.SavePendingSequence();
+  RunEepromWriter();
+  voice_controller.SavePendingSequence();
+  EXPECT(!eeprom_writer.busy());
+  Sequence loaded_sequence;
+  EXPECT(ReadSequence(&loaded_sequence, (uint8_t*)(256)));
+  EXPECT(loaded_sequence.num_notes == 0);
+}
+
+static void TestSystemSettingsJournal() {
+  Reset();
+  RunEepromWriter();
+  
+  // Settings saved by a previous firmware version are loaded.
+  SystemSettingsData legacy = *system_settings.mutable_data();
+  legacy.midi_channel = 5;
+  storage.Save(legacy);
+  RunEepromWriter();
+  system_settings.Init();
+  EXPECT(system_settings.midi_channel() == 5);
+  
+  // Once the journal has been filled, a save only writes the sequence number
+  // and the checksum of the record, if the settings are as they were
+  // kNumSystemSettingsRecords saves ago.
+  uint32_t num_writes = 0;
+  for (uint8_t i = 0; i < 3 * kNumSystemSettingsRecords; ++i) {
+    num_writes = host_eeprom_num_writes;
+    system_settings.set_midi_channel(i & 3);
+    RunEepromWriter();
+    num_writes = host_eeprom_num_writes - num_writes;
+  }
+  EXPECT(num_writes == 2);
+  
+  // The most recent record is found at boot time, with a bounded number of
+  // reads.
+  system_settings.set_midi_channel(9);
+  RunEepromWriter();
+  uint32_t num_reads = host_eeprom_num_reads;
+  system_settings.Init();
+  num_reads = host_eeprom_num_reads - num_reads;
+  EXPECT(system_settings.midi_channel() == 9);
+  EXPECT(num_reads <= kNumSystemSettingsRecords + \
+      2 * kSystemSettingsRecordSize);
+  
+  // An interrupted save falls back on the previous record.
+  system_settings.set_midi_channel(10);
+  RunEepromWriter();
+  for (uint16_t i = kSystemSettingsJournalAddress;
+       i < kSystemSettingsJournalAddress + \
+           kNumSystemSettingsRecords * kSystemSettingsRecordSize;
+       i += kSystemSettingsRecordSize) {
+    if (host_eeprom[i + 1] == 10) {
+      host_eeprom[i + kSystemSettingsRecordSize - 1] ^= 0x55;
+    }
+  }
+  system_settings.Init();
+  EXPECT(system_settings.midi_channel() == 9);
+  system_settings.set_midi_channel(11);
+  RunEepromWriter();
+  system_settings.Init();
+  EXPECT(system_settings.midi_channel() == 11);
+}
+
+static void TestSequence() {
+  Sequence sequence;
+  SequenceWriter writer;
+  SequenceReader reader;
+  
+  // Notes within 16 semitones of the previous one, and runs of rests and
+  // ties, take one byte. Leaps take two.
+  static const uint8_t steps[] = {
+    60, 64, 67, 48, kSequenceRest, kSequenceRest, 51, kSequenceTie, 75, 80,
+    127, 0, kSequenceRest, 36
+  };
+  writer.Init(&sequence);
+  for (uint8_t i = 0; i < sizeof(steps); ++i) {
+    if (i == 2 || i == 9) {
+      writer.set_flags(SEQUENCE_FLAG_ACCENT);
+    }
+    if (i == 4 || i == 10) {
+      writer.set_flags(SEQUENCE_FLAG_SLIDE);
+    }
+    if (steps[i] == kSequenceRest) {
+      writer.AppendRest();
+    } else if (steps[i] == kSequenceTie) {
+      writer.AppendTie();
+    } else {
+      writer.AppendNote(steps[i]);
+    }
+  }
+  EXPECT(sequence.num_notes == sizeof(steps));
+  EXPECT(sequence.size == sizeof(steps) - 1 + 5);
+  
+  // The flags set before a rest are dropped.
+  reader.Init(&sequence);
+  for (uint8_t i = 0; i < sizeof(steps); ++i) {
+    SequenceStep step = reader.Next();
+    uint8_t flags = 0;
+    if (i == 2 || i == 9) {
+      flags = SEQUENCE_FLAG_ACCENT;
+    } else if (i == 10) {
+      flags = SEQUENCE_FLAG_SLIDE;
+    }
+    EXPECT(step.note == steps[i]);
+    EXPECT(step.flags == flags);
+  }
+  EXPECT(reader.Next().note == kSequenceRest);
+  
+  // Long runs are split in runs of 32 steps. Recording stops when the
+  // sequence is full.
+  writer.Init(&sequence);
+  for (uint8_t i = 0; i < 100; ++i) {
+    writer.AppendTie();
+  }
+  EXPECT(sequence.size == 4);
+  reader.Rewind();
+  for (uint8_t i = 0; i < 100; ++i) {
+    EXPECT(reader.Next().note == kSequenceTie);
+  }
+  uint8_t num_notes = 100;
+  while (!writer.full()) {
+    writer.AppendNote(num_notes & 1 ? 30 : 90);
+    ++num_notes;
+  }
+  EXPECT(sequence.num_notes == num_notes);
+  EXPECT(sequence.size <= kSequenceDataSize);
+}
+
+static void WriteLegacySequence(
+    const uint8_t* notes,
+    uint8_t num_notes,
+    uint8_t flags) {
+  // Saved at 256 by the previous versions of the firmware. The flags are
+  // those of the first 8 steps.
+  uint8_t* legacy = host_eeprom + 256;
+  memset(legacy, 0, kLegacySequenceSize);
+  legacy[0] = num_notes;
+  memcpy(legacy + 1, notes, num_notes);
+  legacy[1 + kLegacySequenceLength] = flags;
+  legacy[1 + kLegacySequenceLength + kLegacySequenceFlagsSize] = flags;
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < kLegacySequenceSize; ++i) {
+    checksum += legacy[i];
+  }
+  legacy[kLegacySequenceSize] = checksum;
+}
+
+static void TestLegacySequenceMigration() {
+  Reset();
+  RunEepromWriter();
+  Sequence* sequence = voice_controller.mutable_sequence();
+  SequenceReader reader;
+  
+  // A sequence saved by a previous version of the firmware is converted, and
+  // saved in the packed format.
+  static const uint8_t notes[] = { 60, kSequenceRest, kSequenceTie, 100, 62 };
+  WriteLegacySequence(notes, sizeof(notes), 0x08);
+  voice_controller.Init();
+  RunEepromWriter();
+  for (uint8_t i = 0; i < 2; ++i) {
+    EXPECT(sequence->num_notes == sizeof(notes));
+    reader.Init(sequence);
+    for (uint8_t j = 0; j < sizeof(notes); ++j) {
+      SequenceStep step = reader.Next();
+      EXPECT(step.note == notes[j]);
+      EXPECT(step.flags == (j == 3 ?
+          SEQUENCE_FLAG_ACCENT | SEQUENCE_FLAG_SLIDE : 0));
+    }
+    memset(sequence, 0, sizeof(Sequence));
+    voice_controller.Init();
+  }
+  
+  // Also when its checksum matches that of a packed sequence of 1 byte.
+  static const uint8_t ambiguous_notes[] = { 1, 40, 3 + 1 + 40 };
+  WriteLegacySequence(ambiguous_notes, sizeof(ambiguous_notes), 0);
+  voice_controller.Init();
+  EXPECT(sequence->num_notes == sizeof(ambiguous_notes));
+  reader.Init(sequence);
+  for (uint8_t i = 0; i < sizeof(ambiguous_notes); ++i) {
+    EXPECT(reader.Next().note == ambiguous_notes[i]);
+  }
+  RunEepromWriter();
+}
+
+static void TestProgramStorage() {
+  Reset();
+  RunEepromWriter();
+  Voice* voice = voice_controller.mutable_voice();
+  Patch* patch = voice->mutable_patch();
+  SequencerSettings* settings = voice_controller.mutable_sequencer_settings();
+  Sequence* sequence = voice_controller.mutable_sequence();
+  
+  voice->SetValue(PRM_PATCH_VCO_DCO_RANGE, 1);
+  settings->tempo = 100;
+  SequenceWriter writer;
+  writer.Init(sequence);
+  for (uint8_t i = 0; i < 20; ++i) {
+    if (i == 9) {
+      writer.set_flags(SEQUENCE_FLAG_ACCENT);
+    }
+    writer.AppendNote(48 + i);
+  }
+  EXPECT(voice_controller.StoreProgram(3));
+  // No other store is accepted until the program has been written, and the
+  // program is only listed once it is.
+  EXPECT(!voice_controller.StoreProgram(5));
+  EXPECT(program_storage.empty(3));
+  RunEepromWriter();
+  EXPECT(!program_storage.empty(3));
+  EXPECT(program_storage.empty(5));
+  Patch stored_patch = *patch;
+  
+  // The program is read in place, and only the used part of the data of its
+  // sequence is read. The size of the sequence is read twice.
+  voice->SetValue(PRM_PATCH_VCO_DCO_RANGE, 2);
+  settings->tempo = 120;
+  memset(sequence, 0, sizeof(Sequence));
+  uint32_t num_reads = host_eeprom_num_reads;
+  voice_controller.RecallProgram(3);
+  num_reads = host_eeprom_num_reads - num_reads;
+  EXPECT(num_reads == kProgramFixedSize + 20 + 1);
+  EXPECT(!memcmp(patch, &stored_patch, sizeof(Patch)));
+  EXPECT(settings->tempo == 100);
+  EXPECT(sequence->num_notes == 20);
+  SequenceReader reader;
+  reader.Init(sequence);
+  for (uint8_t i = 0; i < 20; ++i) {
+    SequenceStep step = reader.Next();
+    EXPECT(step.note == 48 + i);
+    EXPECT(step.flags == (i == 9 ? SEQUENCE_FLAG_ACCENT : 0));
+  }
+  
+  // Recalling an empty program does nothing.
+  settings->tempo = 120;
+  voice_controller.RecallProgram(4);
+  EXPECT(settings->tempo == 120);
+  
+  // A program is not recalled while the EEPROM is being written, but once
+  // the writer is done.
+  uint8_t byte = 0x42;
+  storage.Save(&byte, (uint8_t*)(960), 1);
+  voice_controller.RecallProgram(3);
+  voice_controller.RecallPendingProgram();
+  EXPECT(settings->tempo == 120);
+  RunEepromWriter();
+  voice_controller.RecallPendingProgram();
+  EXPECT(settings->tempo == 100);
+  settings->tempo = 120;
+  voice_controller.RecallPendingProgram();
+  EXPECT(settings->tempo == 120);
+  
+  // The directory is loaded at boot time.
+  program_storage.Init();
+  EXPECT(!program_storage.empty(3));
+  EXPECT(program_storage.empty(4));
+  
+  // A store interrupted by a power loss leaves the previous version of the
+  // program.
+  settings->tempo = 90;
+  EXPECT(voice_controller.StoreProgram(3));
+  for (uint8_t i = 0; i < 16; ++i) {
+    eeprom_writer.WriteNextByte();
+  }
+  eeprom_writer.Init();
+  program_storage.Init();
+  voice_controller.RecallProgram(3);
+  EXPECT(settings->tempo == 100);
+  
+  // The blocks are shared by the programs: two more programs with a full
+  // sequence fit. An out-of-range size, received by SysEx, is clamped.
+  sequence->size = 255;
+  EXPECT(voice_controller.StoreProgram(0));
+  RunEepromWriter();
+  EXPECT(voice_controller.StoreProgram(1));
+  RunEepromWriter();
+  EXPECT(!voice_controller.StoreProgram(2));
+  EXPECT(program_storage.empty(2));
+  
+  // A corrupted program is not loaded: the saved patch and sequence are
+  // loaded instead.
+  uint8_t first_block = host_eeprom[kProgramDirectoryAddress + 3 * 2] >> 3;
+  host_eeprom[kProgramBlocksAddress + first_block * kProgramBlockSize] ^= 1;
+  voice_controller.RecallProgram(3);
+  EXPECT(settings->tempo != 100);
+  EXPECT(sequence->num_notes == 4);
+}
+
+int main(void) {
+  TestNoteStack();
+  TestEnvelope();
+  TestInterpolatedCv();
+  TestLfo();
+  TestClock();
+  TestDrumSynth();
+  TestScheduledDrumTrigger();
+  TestVoiceController();
+  TestPerformanceCounters();
+  TestMidiOutRunningStatus();
+  TestMidiOutQueue();
+  TestMidiThru();
+  TestBulkDump();
+  TestPackedSysEx();
+  TestLegacySequenceSysEx();
+  TestSysExThru();
+  TestEepromWriter();
+  TestSystemSettingsJournal();
+  TestSequence();
+  TestLegacySequenceMigration();
+  TestProgramStorage();
+  if (num_failures) {
+    fprintf(stderr, "%d failure(s)\n", num_failures);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
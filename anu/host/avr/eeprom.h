@@ -0,0 +1,76 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host shim for avr/eeprom.h. The 1kb EEPROM of the ATmega328p is emulated by
+// an array, initialized in the erased state (0xff). EEPROM "pointers" are
+// offsets in this array, as on the AVR.
+
+#ifndef ANU_HOST_AVR_EEPROM_H_
+#define ANU_HOST_AVR_EEPROM_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#define E2END 0x3ff
+
+extern uint8_t host_eeprom[E2END + 1];
+// Number of bytes read, and written - to measure the boot time and the wear
+// of the EEPROM.
+extern uint32_t host_eeprom_num_reads;
+extern uint32_t host_eeprom_num_writes;
+
+void host_eeprom_erase();
+
+static inline uint8_t* host_eeprom_address(const void* address) {
+  return host_eeprom + (reinterpret_cast<uintptr_t>(address) & E2END);
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t* address) {
+  ++host_eeprom_num_reads;
+  return *host_eeprom_address(address);
+}
+
+static inline void eeprom_write_byte(uint8_t* address, uint8_t value) {
+  *host_eeprom_address(address) = value;
+  ++host_eeprom_num_writes;
+}
+
+static inline void eeprom_update_byte(uint8_t* address, uint8_t value) {
+  eeprom_write_byte(address, value);
+}
+
+static inline void eeprom_read_block(
+    void* destination,
+    const void* source,
+    size_t size) {
+  memcpy(destination, host_eeprom_address(source), size);
+  host_eeprom_num_reads += size;
+}
+
+static inline void eeprom_write_block(
+    const void* source,
+    void* destination,
+    size_t size) {
+  memcpy(host_eeprom_address(destination), source, size);
+  host_eeprom_num_writes += size;
+}
+
+static inline bool eeprom_is_ready() { return true; }
+static inline void eeprom_busy_wait() { }
+
+#endif  // ANU_HOST_AVR_EEPROM_H_
@@ -0,0 +1,30 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host shim for avr/io.h: only the registers used by the core. The simulator
+// reads them to emulate the interrupts they enable.
+
+#ifndef ANU_HOST_AVR_IO_H_
+#define ANU_HOST_AVR_IO_H_
+
+#include <inttypes.h>
+
+extern volatile uint8_t EECR;
+
+#define EERIE 3
+
+#endif  // ANU_HOST_AVR_IO_H_
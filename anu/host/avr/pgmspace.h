@@ -0,0 +1,57 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host shim for avr/pgmspace.h. Program memory is ordinary memory on the host;
+// multi-byte reads are little-endian, as on the AVR.
+
+#ifndef ANU_HOST_AVR_PGMSPACE_H_
+#define ANU_HOST_AVR_PGMSPACE_H_
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+
+typedef char prog_char;
+typedef uint8_t prog_uint8_t;
+typedef int8_t prog_int8_t;
+typedef uint16_t prog_uint16_t;
+typedef int16_t prog_int16_t;
+typedef uint32_t prog_uint32_t;
+typedef int32_t prog_int32_t;
+
+static inline uint8_t pgm_read_byte(const void* address) {
+  return *static_cast<const uint8_t*>(address);
+}
+
+static inline uint16_t pgm_read_word(const void* address) {
+  const uint8_t* p = static_cast<const uint8_t*>(address);
+  return p[0] | (static_cast<uint16_t>(p[1]) << 8);
+}
+
+static inline uint32_t pgm_read_dword(const void* address) {
+  const uint8_t* p = static_cast<const uint8_t*>(address);
+  return p[0] | (static_cast<uint32_t>(p[1]) << 8) |
+      (static_cast<uint32_t>(p[2]) << 16) |
+      (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline void* memcpy_P(void* destination, const void* source, size_t n) {
+  return memcpy(destination, source, n);
+}
+
+#endif  // ANU_HOST_AVR_PGMSPACE_H_
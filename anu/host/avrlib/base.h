@@ -0,0 +1,70 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host shim for avrlib/base.h: basic types and macros.
+
+#ifndef ANU_HOST_AVRLIB_BASE_H_
+#define ANU_HOST_AVRLIB_BASE_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef union {
+  uint16_t value;
+  uint8_t bytes[2];
+} Word;
+
+typedef union {
+  uint32_t value;
+  uint16_t words[2];
+  uint8_t bytes[4];
+} LongWord;
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif  // _BV
+
+#define STATIC_ASSERT(expression) \
+  do { \
+    typedef char static_assert_size_mismatch[(expression) ? 1 : -1] \
+        __attribute__((unused)); \
+  } while (0)
+
+#define DISALLOW_COPY_AND_ASSIGN(TypeName) \
+  TypeName(const TypeName&); \
+  void operator=(const TypeName&)
+
+namespace avrlib {
+
+template<uint8_t size>
+struct DataTypeForSize {
+  typedef uint16_t Type;
+};
+
+template<> struct DataTypeForSize<1> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<2> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<3> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<4> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<5> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<6> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<7> { typedef uint8_t Type; };
+template<> struct DataTypeForSize<8> { typedef uint8_t Type; };
+
+}  // namespace avrlib
+
+#endif  // ANU_HOST_AVRLIB_BASE_H_
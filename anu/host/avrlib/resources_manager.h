@@ -0,0 +1,57 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host shim for avrlib/resources_manager.h. Only the type declarations are
+// needed by the generated resources header.
+
+#ifndef ANU_HOST_AVRLIB_RESOURCES_MANAGER_H_
+#define ANU_HOST_AVRLIB_RESOURCES_MANAGER_H_
+
+#include "avrlib/base.h"
+
+#include <avr/pgmspace.h>
+
+namespace avrlib {
+
+template<
+    const prog_char** strings,
+    const prog_uint16_t** lookup_tables>
+struct ResourcesTables {
+  static inline const prog_char** string_table() { return strings; }
+  static inline const prog_uint16_t** lookup_table_table() {
+    return lookup_tables;
+  }
+};
+
+template<typename ResourceId, typename Tables>
+class ResourcesManager {
+ public:
+  template<typename ResultType>
+  static inline ResultType Lookup(ResourceId resource, uint8_t i) {
+    const prog_uint16_t* table = Tables::lookup_table_table()[resource];
+    return static_cast<ResultType>(pgm_read_word(table + i));
+  }
+
+  template<typename T>
+  static inline void Load(const T* p, uint8_t i, T* destination) {
+    memcpy_P(destination, p + i, sizeof(T));
+  }
+};
+
+}  // namespace avrlib
+
+#endif  // ANU_HOST_AVRLIB_RESOURCES_MANAGER_H_
@@ -0,0 +1,360 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Bit-exact regression harness. A fixed set of scenarios (MIDI input and
+// parameter changes, with a seeded random number generator) is played through
+// the simulated firmware, and two streams are recorded for each of them:
+// - audio: the 8-bit samples rendered by DrumSynth::Render, in the order in
+//   which they are read by the audio interrupt.
+// - dac: the DACState samples written by Voice::WriteDACStateSample, in the
+//   order in which they are read by the DAC interrupt (4 little-endian 16-bit
+//   words: vco, pw, vcf, vca).
+// Each stream is summarized by its length and 64-bit FNV-1a hash, and compared
+// to a manifest of reference values.
+//
+// anu_golden manifest                 checks the streams against the manifest.
+// anu_golden --record manifest        rewrites the manifest.
+// anu_golden --dump directory ...     also writes the raw streams, for diffing.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "avrlib/random.h"
+
+#include "anu/drum_synth.h"
+#include "anu/host/simulator.h"
+#include "anu/voice_controller.h"
+
+using namespace anu;
+using namespace std;
+
+static vector<uint8_t> audio_stream;
+static vector<uint8_t> dac_stream;
+
+static void Run(uint32_t num_samples) {
+  while (num_samples--) {
+    audio_stream.push_back(simulator.Tick());
+    if (simulator.dac_updated()) {
+      const DACState& state = simulator.dac_state();
+      const uint16_t words[4] = {
+        state.vco_cv, state.pw_cv, state.vcf_cv, state.vca_cv
+      };
+      for (uint8_t i = 0; i < 4; ++i) {
+        dac_stream.push_back(words[i] & 0xff);
+        dac_stream.push_back(words[i] >> 8);
+      }
+    }
+  }
+}
+
+static void Send(uint8_t status, uint8_t data_1, uint8_t data_2) {
+  simulator.PushMidiByte(status);
+  simulator.PushMidiByte(data_1);
+  simulator.PushMidiByte(data_2);
+}
+
+static void Send(uint8_t status, uint8_t data_1) {
+  simulator.PushMidiByte(status);
+  simulator.PushMidiByte(data_1);
+}
+
+// ------ Scenarios ------------------------------------------------------------
+
+// Drum voices triggered from MIDI channel 10, with their parameters swept by
+// CCs, and retriggered before the end of their decay.
+static void ScenarioDrumsMidi() {
+  static const uint8_t notes[] = { 36, 38, 42 };
+  for (uint8_t i = 0; i < 48; ++i) {
+    Send(0x99, notes[i % 3], 16 + (i * 37) % 112);
+    if ((i & 3) == 0) {
+      Send(0xb9, 16 + (i >> 2) % 15, (i * 23) & 0x7f);
+    }
+    Run(1000 + (i * 311) % 1500);
+  }
+  Run(20000);
+}
+
+// Drum voices at a reduced bandwidth, with various balance settings.
+static void ScenarioDrumsBandwidth() {
+  static const uint8_t bandwidths[] = { 0, 64, 160, 255 };
+  for (uint8_t i = 0; i < 4; ++i) {
+    voice_controller.SetValue(PRM_SEQ_DRUMS_BANDWIDTH, bandwidths[i]);
+    voice_controller.SetValue(PRM_SEQ_DRUMS_BALANCE, i * 80);
+    for (uint8_t j = 0; j < 6; ++j) {
+      Send(0x99, j & 1 ? 38 : 36, 127);
+      Run(1200);
+      Send(0x99, 42, 80 + j * 8);
+      Run(1800);
+    }
+  }
+}
+
+// Drum machine driven by the internal clock, with swing, and the pattern
+// morphed while it plays.
+static void ScenarioDrumMachine() {
+  voice_controller.SetValue(PRM_SEQ_TEMPO, 150);
+  voice_controller.SetValue(PRM_SEQ_SWING, 40);
+  voice_controller.SetValue(PRM_SEQ_DRUMS_BD_DENSITY, 200);
+  voice_controller.SetValue(PRM_SEQ_DRUMS_SD_DENSITY, 150);
+  voice_controller.SetValue(PRM_SEQ_DRUMS_HH_DENSITY, 220);
+  voice_controller.Start();
+  for (uint8_t i = 0; i < 8; ++i) {
+    voice_controller.SetValue(PRM_SEQ_DRUMS_X, i * 32);
+    voice_controller.SetValue(PRM_SEQ_DRUMS_Y, 255 - i * 32);
+    voice_controller.SetValue(PRM_SEQ_DRUMS_BD_TONE, i * 30);
+    Run(12000);
+  }
+  voice_controller.Stop();
+  Run(10000);
+}
+
+// Mono synth voice played from MIDI channel 1: legato and staccato notes,
+// glide, pitch bend, modulation wheel, aftertouch, and CC sweeps of the patch
+// parameters - including all the LFO shapes.
+static void ScenarioSynth() {
+  Send(0xb0, 5, 40);  // Glide.
+  for (uint8_t i = 0; i < 32; ++i) {
+    uint8_t cc = 16 + i % 16;
+    Send(0xb0, cc, (i * 29) & 0x7f);
+    Send(0xb0, 54, (i & 7) << 4);  // LFO shape.
+    Send(0xb0, 55, 64 + i);  // LFO rate.
+    Send(0x90, 36 + (i * 7) % 36, 30 + (i * 13) % 97);
+    Run(1500);
+    if (i & 1) {
+      Send(0xe0, 0, (i * 9) & 0x7f);
+      Send(0xb0, 1, (i * 17) & 0x7f);
+      Send(0xd0, (i * 5) & 0x7f);
+    }
+    Run(1000);
+    if (i % 3) {
+      Send(0x80, 36 + (i * 7) % 36, 0);
+    }
+    Run(500);
+  }
+  Send(0xb0, 123, 0);
+  Run(20000);
+}
+
+// Arpeggiator in random mode on a held chord, clocked internally.
+static void ScenarioArpeggiator() {
+  voice_controller.SetValue(PRM_SEQ_TEMPO, 180);
+  voice_controller.SetValue(PRM_SEQ_ARP_MODE, 7);
+  voice_controller.SetValue(PRM_SEQ_ARP_ACIDITY, 100);
+  Send(0x90, 48, 100);
+  Send(0x90, 52, 90);
+  Send(0x90, 55, 80);
+  // The notes are parsed by the main loop before the sequencer is started.
+  Run(1);
+  voice_controller.Start();
+  Run(60000);
+  Send(0x80, 52, 0);
+  Run(20000);
+  voice_controller.Stop();
+  Run(10000);
+}
+
+// Step sequence recorded from MIDI - with rests, ties, accents, slides and
+// leaps of more than an octave - then played on the internal clock, and
+// transposed while it plays.
+static void ScenarioSequencer() {
+  voice_controller.StartRecording();
+  for (uint8_t i = 0; i < 48; ++i) {
+    if (i % 8 == 2 || i % 8 == 6 || i % 8 == 7) {
+      voice_controller.InsertRest();
+      continue;
+    } else if (i % 8 == 4) {
+      voice_controller.InsertTie();
+      continue;
+    }
+    uint8_t note = 36 + (i * 7) % 30 + (i % 5 == 0 ? 24 : 0);
+    if (i % 3 == 0) {
+      Send(0xb0, 1, 127);  // Accent.
+    }
+    if (i % 4 == 1) {
+      Send(0xe0, 0, 0x7f);  // Slide.
+    }
+    Send(0x90, note, 100);
+    Run(100);
+    Send(0x80, note, 0);
+    Send(0xb0, 1, 0);
+    Send(0xe0, 0, 0x40);
+    Run(100);
+  }
+  voice_controller.StopRecording();
+  voice_controller.SetValue(PRM_SEQ_TEMPO, 160);
+  voice_controller.Start();
+  Run(60000);
+  Send(0x90, 67, 90);
+  Run(40000);
+  voice_controller.Stop();
+  Run(10000);
+}
+
+struct Scenario {
+  const char* name;
+  uint16_t seed;
+  void (*play)();
+};
+
+static const Scenario scenarios[] = {
+  { "drums_midi", 0x21, &ScenarioDrumsMidi },
+  { "drums_bandwidth", 0x1234, &ScenarioDrumsBandwidth },
+  { "drum_machine", 0xbeef, &ScenarioDrumMachine },
+  { "synth", 0x5eed, &ScenarioSynth },
+  { "arpeggiator", 0xace1, &ScenarioArpeggiator },
+  { "sequencer", 0x5e9, &ScenarioSequencer },
+};
+
+// ------ Manifest -------------------------------------------------------------
+
+static uint64_t Hash(const vector<uint8_t>& stream) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < stream.size(); ++i) {
+    hash ^= stream[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static string FormatEntry(
+    const char* scenario,
+    const char* stream_name,
+    const vector<uint8_t>& stream) {
+  char entry[128];
+  sprintf(
+      entry,
+      "%s %s %lu %016llx",
+      scenario,
+      stream_name,
+      static_cast<unsigned long>(stream.size()),
+      static_cast<unsigned long long>(Hash(stream)));
+  return entry;
+}
+
+static void Dump(
+    const char* directory,
+    const char* scenario,
+    const char* stream_name,
+    const vector<uint8_t>& stream) {
+  string file_name = string(directory) + "/" + scenario + "_" + stream_name + \
+      ".bin";
+  FILE* fp = fopen(file_name.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Cannot write %s\n", file_name.c_str());
+    return;
+  }
+  if (!stream.empty()) {
+    fwrite(&stream[0], 1, stream.size(), fp);
+  }
+  fclose(fp);
+}
+
+static void Usage() {
+  fprintf(stderr,
+      "Usage: anu_golden [--record] [--dump directory] manifest\n");
+}
+
+int main(int argc, char** argv) {
+  bool record = false;
+  const char* dump_directory = NULL;
+  const char* manifest = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--record")) {
+      record = true;
+    } else if (!strcmp(argv[i], "--dump") && i + 1 < argc) {
+      dump_directory = argv[++i];
+    } else if (!manifest) {
+      manifest = argv[i];
+    } else {
+      Usage();
+      return 1;
+    }
+  }
+  if (!manifest) {
+    Usage();
+    return 1;
+  }
+  
+  vector<string> entries;
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(Scenario); ++i) {
+    const Scenario& scenario = scenarios[i];
+    audio_stream.clear();
+    dac_stream.clear();
+    simulator.Init();
+    avrlib::Random::Seed(scenario.seed);
+    scenario.play();
+    entries.push_back(FormatEntry(scenario.name, "audio", audio_stream));
+    entries.push_back(FormatEntry(scenario.name, "dac", dac_stream));
+    if (dump_directory) {
+      Dump(dump_directory, scenario.name, "audio", audio_stream);
+      Dump(dump_directory, scenario.name, "dac", dac_stream);
+    }
+  }
+  
+  if (record) {
+    FILE* fp = fopen(manifest, "w");
+    if (!fp) {
+      fprintf(stderr, "Cannot write %s\n", manifest);
+      return 1;
+    }
+    fprintf(fp, "# scenario stream size fnv1a64\n");
+    for (size_t i = 0; i < entries.size(); ++i) {
+      fprintf(fp, "%s\n", entries[i].c_str());
+    }
+    fclose(fp);
+    printf("Recorded %d streams\n", static_cast<int>(entries.size()));
+    return 0;
+  }
+  
+  FILE* fp = fopen(manifest, "r");
+  if (!fp) {
+    fprintf(stderr, "Cannot read %s\n", manifest);
+    return 1;
+  }
+  vector<string> expected;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] && line[0] != '#') {
+      expected.push_back(line);
+    }
+  }
+  fclose(fp);
+  
+  int num_mismatches = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (i >= expected.size() || expected[i] != entries[i]) {
+      fprintf(stderr, "Mismatch: got      %s\n", entries[i].c_str());
+      fprintf(stderr, "          expected %s\n",
+          i < expected.size() ? expected[i].c_str() : "(nothing)");
+      ++num_mismatches;
+    }
+  }
+  if (expected.size() != entries.size()) {
+    fprintf(stderr, "Expected %d streams, got %d\n",
+        static_cast<int>(expected.size()), static_cast<int>(entries.size()));
+    ++num_mismatches;
+  }
+  if (num_mismatches) {
+    return 1;
+  }
+  printf("All %d streams match\n", static_cast<int>(entries.size()));
+  return 0;
+}
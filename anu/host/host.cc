@@ -0,0 +1,79 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Storage for the host shims of avrlib and avr-libc.
+
+#include "avrlib/random.h"
+#include "avrlib/time.h"
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+
+/* extern */
+uint8_t host_eeprom[E2END + 1];
+
+/* extern */
+uint32_t host_eeprom_num_reads;
+
+/* extern */
+uint32_t host_eeprom_num_writes;
+
+void host_eeprom_erase() {
+  memset(host_eeprom, 0xff, sizeof(host_eeprom));
+  host_eeprom_num_reads = 0;
+  host_eeprom_num_writes = 0;
+}
+
+/* extern */
+volatile uint8_t EECR;
+
+static struct HostEepromInitializer {
+  HostEepromInitializer() { host_eeprom_erase(); }
+} host_eeprom_initializer;
+
+namespace avrlib {
+
+/* static */
+uint16_t Random::rng_state_ = 0x21;
+
+// The firmware ticks the system clock every 8th overflow of timer 0, which
+// runs at 20MHz / 8 / 510, that is to say every 1632us.
+static const uint16_t kMillisecondsPerTick = 1;
+static const uint16_t kMicrosecondsPerTickFractional = 632;
+
+static uint32_t system_clock_ms = 0;
+static uint16_t system_clock_us = 0;
+
+uint32_t milliseconds() {
+  return system_clock_ms;
+}
+
+void TickSystemClock() {
+  system_clock_ms += kMillisecondsPerTick;
+  system_clock_us += kMicrosecondsPerTickFractional;
+  if (system_clock_us >= 1000) {
+    system_clock_us -= 1000;
+    ++system_clock_ms;
+  }
+}
+
+void ResetSystemClock() {
+  system_clock_ms = 0;
+  system_clock_us = 0;
+}
+
+}  // namespace avrlib
@@ -0,0 +1,210 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Standard MIDI File reader.
+
+#include "anu/host/midi_file.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace anu {
+
+using namespace std;
+
+static const uint32_t kDefaultTempo = 500000;
+
+static inline uint32_t ReadBigEndian(const uint8_t* data, uint8_t size) {
+  uint32_t value = 0;
+  while (size--) {
+    value = (value << 8) | *data++;
+  }
+  return value;
+}
+
+static bool ReadVariableLength(
+    const uint8_t** data,
+    const uint8_t* end,
+    uint32_t* value) {
+  *value = 0;
+  for (uint8_t i = 0; i < 4; ++i) {
+    if (*data >= end) {
+      return false;
+    }
+    uint8_t byte = *(*data)++;
+    *value = (*value << 7) | (byte & 0x7f);
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* static */
+bool MidiFile::CompareTicks(const TrackEvent& a, const TrackEvent& b) {
+  return a.tick < b.tick;
+}
+
+bool MidiFile::ParseTrack(const uint8_t* data, uint32_t size) {
+  const uint8_t* end = data + size;
+  uint32_t tick = 0;
+  uint8_t running_status = 0;
+  while (data < end) {
+    uint32_t delta;
+    if (!ReadVariableLength(&data, end, &delta) || data >= end) {
+      return false;
+    }
+    tick += delta;
+    
+    TrackEvent event;
+    event.tick = tick;
+    event.tempo = 0;
+    uint8_t status = *data;
+    if (status == 0xff) {
+      // Meta event. Only the tempo changes are kept.
+      if (end - data < 2) {
+        return false;
+      }
+      uint8_t type = data[1];
+      data += 2;
+      uint32_t length;
+      if (!ReadVariableLength(&data, end, &length) || end - data < length) {
+        return false;
+      }
+      if (type == 0x51 && length == 3) {
+        event.tempo = ReadBigEndian(data, 3);
+        track_events_.push_back(event);
+      }
+      data += length;
+      if (type == 0x2f) {
+        break;
+      }
+    } else if (status == 0xf0 || status == 0xf7) {
+      // SysEx event, or escaped sequence of raw bytes.
+      ++data;
+      uint32_t length;
+      if (!ReadVariableLength(&data, end, &length) || end - data < length) {
+        return false;
+      }
+      if (status == 0xf0) {
+        event.data.push_back(0xf0);
+      }
+      event.data.insert(event.data.end(), data, data + length);
+      track_events_.push_back(event);
+      data += length;
+      running_status = 0;
+    } else {
+      if (status & 0x80) {
+        running_status = status;
+        ++data;
+      } else if (!running_status) {
+        return false;
+      }
+      uint8_t hi = running_status & 0xf0;
+      uint8_t data_size = (hi == 0xc0 || hi == 0xd0) ? 1 : 2;
+      if (end - data < data_size) {
+        return false;
+      }
+      event.data.push_back(running_status);
+      event.data.insert(event.data.end(), data, data + data_size);
+      track_events_.push_back(event);
+      data += data_size;
+    }
+  }
+  return true;
+}
+
+bool MidiFile::Load(const char* file_name) {
+  events_.clear();
+  track_events_.clear();
+  
+  FILE* fp = fopen(file_name, "rb");
+  if (!fp) {
+    return false;
+  }
+  vector<uint8_t> file;
+  uint8_t buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+    file.insert(file.end(), buffer, buffer + read);
+  }
+  fclose(fp);
+  
+  const uint8_t* data = file.empty() ? NULL : &file[0];
+  const uint8_t* end = data + file.size();
+  if (file.size() < 14 ||
+      memcmp(data, "MThd", 4) ||
+      ReadBigEndian(data + 4, 4) < 6) {
+    return false;
+  }
+  uint16_t num_tracks = ReadBigEndian(data + 10, 2);
+  uint16_t division = ReadBigEndian(data + 12, 2);
+  if (!(division & 0x7fff)) {
+    return false;
+  }
+  data += 8 + ReadBigEndian(data + 4, 4);
+  
+  for (uint16_t i = 0; i < num_tracks; ++i) {
+    if (end - data < 8) {
+      return false;
+    }
+    uint32_t chunk_size = ReadBigEndian(data + 4, 4);
+    if (end - data - 8 < chunk_size) {
+      return false;
+    }
+    if (!memcmp(data, "MTrk", 4) && !ParseTrack(data + 8, chunk_size)) {
+      return false;
+    }
+    data += 8 + chunk_size;
+  }
+  
+  // The events of all the tracks are merged. For the events occurring at the
+  // same tick, the order of the tracks is preserved.
+  stable_sort(track_events_.begin(), track_events_.end(), CompareTicks);
+  
+  // Convert the ticks to seconds.
+  double seconds_per_tick;
+  bool smpte = division & 0x8000;
+  if (smpte) {
+    int8_t frames_per_second = -static_cast<int8_t>(division >> 8);
+    seconds_per_tick = 1.0 / (frames_per_second * (division & 0xff));
+  } else {
+    seconds_per_tick = kDefaultTempo * 1e-6 / division;
+  }
+  uint32_t previous_tick = 0;
+  double time = 0.0;
+  for (size_t i = 0; i < track_events_.size(); ++i) {
+    const TrackEvent& event = track_events_[i];
+    time += (event.tick - previous_tick) * seconds_per_tick;
+    previous_tick = event.tick;
+    if (event.tempo) {
+      if (!smpte) {
+        seconds_per_tick = event.tempo * 1e-6 / division;
+      }
+    } else {
+      MidiFileEvent e;
+      e.time = time;
+      e.data = event.data;
+      events_.push_back(e);
+    }
+  }
+  track_events_.clear();
+  return true;
+}
+
+}  // namespace anu
@@ -0,0 +1,66 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Standard MIDI File reader. All the tracks are merged into a single list of
+// MIDI messages, timestamped in seconds according to the tempo map. Meta
+// events are not included in the list.
+
+#ifndef ANU_HOST_MIDI_FILE_H_
+#define ANU_HOST_MIDI_FILE_H_
+
+#include "avrlib/base.h"
+
+#include <vector>
+
+namespace anu {
+
+struct MidiFileEvent {
+  double time;
+  std::vector<uint8_t> data;
+};
+
+class MidiFile {
+ public:
+  MidiFile() { }
+  
+  // Returns false if the file cannot be read or is not a valid SMF.
+  bool Load(const char* file_name);
+  
+  const std::vector<MidiFileEvent>& events() const { return events_; }
+  double duration() const {
+    return events_.empty() ? 0.0 : events_.back().time;
+  }
+  
+ private:
+  struct TrackEvent {
+    uint32_t tick;
+    uint32_t tempo;  // In microseconds per quarter note, 0 if not a tempo event.
+    std::vector<uint8_t> data;
+  };
+  
+  static bool CompareTicks(const TrackEvent& a, const TrackEvent& b);
+  bool ParseTrack(const uint8_t* data, uint32_t size);
+  
+  std::vector<TrackEvent> track_events_;
+  std::vector<MidiFileEvent> events_;
+  
+  DISALLOW_COPY_AND_ASSIGN(MidiFile);
+};
+
+}  // namespace anu
+
+#endif  // ANU_HOST_MIDI_FILE_H_
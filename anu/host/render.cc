@@ -0,0 +1,122 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Offline renderer: plays a Standard MIDI File through the simulated firmware,
+// and writes the PWM audio output (8-bit, at the rate of the audio interrupt)
+// to a WAV file. Optionally, the CVs sent to the DACs are written to a second,
+// 4-channel WAV file at the DAC refresh rate - in the order VCO, VCF, VCA, PW;
+// with the 12-bit DAC codes scaled to the full 16-bit range.
+//
+// Usage: anu_render [-t tail_in_seconds] input.mid audio.wav [cv.wav]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "anu/performance_counters.h"
+#include "anu/host/midi_file.h"
+#include "anu/host/simulator.h"
+#include "anu/host/wav_writer.h"
+
+using namespace anu;
+
+static void Usage() {
+  fprintf(stderr,
+      "Usage: anu_render [-t tail_in_seconds] input.mid audio.wav [cv.wav]\n");
+  exit(1);
+}
+
+static inline int16_t DACCodeToSample(uint16_t code) {
+  return static_cast<int16_t>((code << 4) - 32768);
+}
+
+int main(int argc, char** argv) {
+  double tail = 2.0;
+  int argi = 1;
+  if (argi + 1 < argc && !strcmp(argv[argi], "-t")) {
+    tail = atof(argv[argi + 1]);
+    argi += 2;
+  }
+  if (argc - argi < 2 || argc - argi > 3) {
+    Usage();
+  }
+  const char* midi_file_name = argv[argi];
+  const char* audio_file_name = argv[argi + 1];
+  const char* cv_file_name = argc - argi == 3 ? argv[argi + 2] : NULL;
+  
+  MidiFile midi_file;
+  if (!midi_file.Load(midi_file_name)) {
+    fprintf(stderr, "Cannot read MIDI file %s\n", midi_file_name);
+    return 1;
+  }
+  WavWriter audio;
+  if (!audio.Open(audio_file_name, 1, kSimulatorAudioRate, 8)) {
+    fprintf(stderr, "Cannot write %s\n", audio_file_name);
+    return 1;
+  }
+  WavWriter cv;
+  if (cv_file_name && !cv.Open(cv_file_name, 4, kSimulatorDACRate, 16)) {
+    fprintf(stderr, "Cannot write %s\n", cv_file_name);
+    return 1;
+  }
+  
+  simulator.Init();
+  
+  const std::vector<MidiFileEvent>& events = midi_file.events();
+  uint32_t num_samples = static_cast<uint32_t>(
+      (midi_file.duration() + tail) * kSimulatorAudioRate);
+  size_t next_event = 0;
+  clock_t start = clock();
+  for (uint32_t i = 0; i < num_samples; ++i) {
+    double now = static_cast<double>(i) / kSimulatorAudioRate;
+    while (next_event < events.size() && events[next_event].time <= now) {
+      const std::vector<uint8_t>& data = events[next_event].data;
+      for (size_t j = 0; j < data.size(); ++j) {
+        simulator.PushMidiByte(data[j]);
+      }
+      ++next_event;
+    }
+    uint8_t sample = simulator.Tick();
+    audio.Write(&sample);
+    if (cv_file_name && simulator.dac_updated()) {
+      const DACState& state = simulator.dac_state();
+      int16_t frame[4];
+      frame[0] = DACCodeToSample(state.vco_cv);
+      frame[1] = DACCodeToSample(state.vcf_cv);
+      frame[2] = DACCodeToSample(state.vca_cv);
+      frame[3] = DACCodeToSample(state.pw_cv);
+      cv.Write(frame);
+    }
+  }
+  double elapsed = static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+  double duration = static_cast<double>(num_samples) / kSimulatorAudioRate;
+  
+  fprintf(stderr, "Rendered %.2fs in %.2fs (%.1fx real time)\n",
+      duration, elapsed, elapsed > 0.0 ? duration / elapsed : 0.0);
+  uint32_t num_dac_updates = num_samples / 16;
+  fprintf(stderr, "%u DAC words sent out of %u (%.1f%%)\n",
+      simulator.num_dac_words(), num_dac_updates * 4,
+      num_dac_updates ? 25.0 * simulator.num_dac_words() / num_dac_updates : 0.0);
+  fprintf(stderr, "%u MIDI bytes sent\n", simulator.num_midi_out_bytes());
+  const PerformanceCountersData& counters = performance_counters.data();
+  if (counters.audio_underruns || counters.dac_underruns) {
+    fprintf(stderr, "%u audio buffer underruns, %u DAC buffer underruns\n",
+        counters.audio_underruns, counters.dac_underruns);
+  }
+  return 0;
+}
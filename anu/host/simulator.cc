@@ -0,0 +1,199 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host simulation of the firmware main loop and interrupt handlers.
+
+#include "anu/host/simulator.h"
+
+#include "avrlib/random.h"
+#include "avrlib/time.h"
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+
+#include <new>
+
+#include "anu/audio_buffer.h"
+#include "anu/clock.h"
+#include "anu/drum_synth.h"
+#include "anu/eeprom_writer.h"
+#include "anu/midi_dispatcher.h"
+#include "anu/midi_out_queue.h"
+#include "anu/performance_counters.h"
+#include "anu/program_storage.h"
+#include "anu/sysex_handler.h"
+#include "anu/system_settings.h"
+
+#include "midi/midi.h"
+
+namespace anu {
+
+using namespace avrlib;
+
+static MidiInBuffer midi_in_buffer;
+static midi::MidiStreamParser<MidiDispatcher> midi_parser;
+
+/* static */
+uint32_t Simulator::num_samples_;
+
+/* static */
+uint8_t Simulator::sample_;
+
+/* static */
+uint8_t Simulator::cycle_;
+
+/* static */
+bool Simulator::dac_updated_;
+
+/* static */
+uint32_t Simulator::num_dac_words_;
+
+/* static */
+uint32_t Simulator::num_midi_out_bytes_;
+
+/* static */
+void Simulator::Init() {
+  host_eeprom_erase();
+  ResetSystemClock();
+  Random::Seed(0x21);
+  audio_buffer.Init();
+  eeprom_writer.Init();
+  program_storage.Init();
+  while (midi_dispatcher.readable_high_priority()) {
+    midi_dispatcher.ImmediateReadHighPriority();
+  }
+  midi_out_queue.Init();
+  midi_dispatcher.ResetDrumEventMonitor();
+  midi_in_buffer.Flush();
+  new (&midi_parser) midi::MidiStreamParser<MidiDispatcher>();
+  
+  performance_counters.Init();
+  system_settings.Init();
+  drum_synth.Init();
+  voice_controller.Init();
+  
+  num_samples_ = 0;
+  sample_ = 0;
+  cycle_ = 0;
+  dac_updated_ = false;
+  num_dac_words_ = 0;
+  num_midi_out_bytes_ = 0;
+}
+
+/* static */
+void Simulator::PushMidiByte(uint8_t byte) {
+  // Same as the UART receive interrupt.
+  TimestampedMidiByte timestamped_byte;
+  timestamped_byte.value = byte;
+  timestamped_byte.timestamp.audio = audio_buffer.read_position();
+  timestamped_byte.timestamp.dac = voice_controller.voice().dac_timestamp();
+  if (!midi_in_buffer.NonBlockingWrite(timestamped_byte)) {
+    performance_counters.CountMidiInOverrun();
+  }
+}
+
+/* static */
+void Simulator::RunMainLoop() {
+  performance_counters.set_main_loop_busy(
+      voice_controller.voice().writable() ||
+      audio_buffer.writable() ||
+      midi_in_buffer.readable());
+  voice_controller.mutable_voice()->Refresh();
+  if (voice_controller.has_drums() ||
+      midi_dispatcher.seen_midi_drum_events() ||
+      drum_synth.playing()) {
+    drum_synth.Render();
+  } else {
+    drum_synth.FillWithSilence();
+  }
+  if (drum_synth.idle_time_ms() > 300000) {
+    midi_dispatcher.ResetDrumEventMonitor();
+  }
+  if (voice_controller.internal_clock()) {
+    uint8_t num_events = clock.CountEvents();
+    while (num_events) {
+      voice_controller.Clock(false);
+      --num_events;
+    }
+  }
+  while (midi_in_buffer.readable()) {
+    TimestampedMidiByte byte = midi_in_buffer.ImmediateRead();
+    midi_dispatcher.set_timestamp(byte.timestamp);
+    midi_parser.PushByte(byte.value);
+  }
+  voice_controller.RecallPendingProgram();
+  voice_controller.SavePendingSequence();
+  sysex_handler.Refresh();
+}
+
+/* static */
+void Simulator::RunDACTimerHandler() {
+  if (cycle_ & 1) {
+    Voice* voice = voice_controller.mutable_voice();
+    if (voice->readable()) {
+      voice->ReadDACStateSample();
+    } else {
+      performance_counters.CountDACUnderrun();
+    }
+    uint8_t changes = voice->TakeDACStateChanges();
+    while (changes) {
+      num_dac_words_ += changes & 1;
+      changes >>= 1;
+    }
+    dac_updated_ = true;
+  }
+  
+  // The MIDI output is discarded.
+  uint8_t byte;
+  if (midi_dispatcher.ReadOutput(&byte)) {
+    ++num_midi_out_bytes_;
+  }
+  performance_counters.Sample();
+  
+  voice_controller.mutable_voice()->ClearRetriggeredFlag();
+  if (voice_controller.clock_pulse()) {
+    voice_controller.ClearClockPulse();
+  }
+  if ((cycle_ & 0x7) == 0) {
+    TickSystemClock();
+  }
+  ++cycle_;
+}
+
+/* static */
+uint8_t Simulator::Tick() {
+  dac_updated_ = false;
+  RunMainLoop();
+  
+  clock.Tick();
+  sample_ = audio_buffer.ImmediateRead();
+  
+  if ((num_samples_ & 7) == 0) {
+    RunDACTimerHandler();
+  }
+  if ((num_samples_ % kSimulatorEepromWriteTime) == 0 &&
+      (EECR & _BV(EERIE))) {
+    eeprom_writer.WriteNextByte();
+  }
+  ++num_samples_;
+  return sample_;
+}
+
+/* extern */
+Simulator simulator;
+
+}  // namespace anu
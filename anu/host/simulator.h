@@ -0,0 +1,92 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Host simulation of the firmware main loop and interrupt handlers.
+//
+// The time unit is the period of the audio interrupt (timer 2, 20MHz / 510).
+// Timer 0 runs with a prescaler of 8 and the same phase-correct PWM mode, so
+// its handler runs exactly once every 8 audio samples; and updates the DACs
+// on every other call. The main loop is run once before each audio sample.
+// The UI, the DCO tuner and the gate/trig inputs are not simulated.
+
+#ifndef ANU_HOST_SIMULATOR_H_
+#define ANU_HOST_SIMULATOR_H_
+
+#include "avrlib/base.h"
+
+#include "anu/voice_controller.h"
+
+namespace anu {
+
+// 20MHz / 510, rounded to the nearest integer.
+static const uint32_t kSimulatorAudioRate = 39216;
+// 20MHz / 510 / 16, rounded to the nearest integer.
+static const uint32_t kSimulatorDACRate = 2451;
+// Time taken by the write of an EEPROM byte (3.4ms), in samples. The EE_READY
+// interrupt is run at this rate when it is enabled.
+static const uint32_t kSimulatorEepromWriteTime = 133;
+
+class Simulator {
+ public:
+  Simulator() { }
+  
+  // Resets the EEPROM, the random number generator, the system clock and all
+  // the firmware modules, as on a cold boot with a blank EEPROM.
+  static void Init();
+  
+  // Receives a MIDI byte at the current time. It is parsed by the next run of
+  // the main loop.
+  static void PushMidiByte(uint8_t byte);
+  
+  // Runs the main loop and the interrupt handlers for one audio sample.
+  // Returns the sample written to the PWM output.
+  static uint8_t Tick();
+  
+  static uint32_t num_samples() { return num_samples_; }
+  
+  // True when the DACs have been updated by the last call to Tick().
+  static bool dac_updated() { return dac_updated_; }
+  static const DACState& dac_state() {
+    return voice_controller.voice().dac_state();
+  }
+  
+  // Number of 16-bit words the firmware would have sent to the DACs: the
+  // channels which have not changed are not sent.
+  static uint32_t num_dac_words() { return num_dac_words_; }
+  
+  // Number of bytes sent to the MIDI out.
+  static uint32_t num_midi_out_bytes() { return num_midi_out_bytes_; }
+  
+ private:
+  static void RunMainLoop();
+  static void RunDACTimerHandler();
+   
+  static uint32_t num_samples_;
+  static uint8_t sample_;
+  static uint8_t cycle_;
+  static bool dac_updated_;
+  static uint32_t num_dac_words_;
+  static uint32_t num_midi_out_bytes_;
+  
+  DISALLOW_COPY_AND_ASSIGN(Simulator);
+};
+
+extern Simulator simulator;
+
+}  // namespace anu
+
+#endif  // ANU_HOST_SIMULATOR_H_
@@ -0,0 +1,87 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Minimal writer for PCM WAV files.
+
+#include "anu/host/wav_writer.h"
+
+namespace anu {
+
+static void WriteLittleEndian(FILE* fp, uint32_t value, uint8_t size) {
+  while (size--) {
+    fputc(value & 0xff, fp);
+    value >>= 8;
+  }
+}
+
+bool WavWriter::Open(
+    const char* file_name,
+    uint16_t num_channels,
+    uint32_t sample_rate,
+    uint16_t bits_per_sample) {
+  Close();
+  fp_ = fopen(file_name, "wb");
+  if (!fp_) {
+    return false;
+  }
+  num_channels_ = num_channels;
+  sample_rate_ = sample_rate;
+  bits_per_sample_ = bits_per_sample;
+  num_frames_ = 0;
+  WriteHeader();
+  return true;
+}
+
+void WavWriter::WriteHeader() {
+  uint16_t block_align = num_channels_ * bits_per_sample_ / 8;
+  uint32_t data_size = num_frames_ * block_align;
+  fwrite("RIFF", 1, 4, fp_);
+  WriteLittleEndian(fp_, 36 + data_size, 4);
+  fwrite("WAVEfmt ", 1, 8, fp_);
+  WriteLittleEndian(fp_, 16, 4);
+  WriteLittleEndian(fp_, 1, 2);  // PCM.
+  WriteLittleEndian(fp_, num_channels_, 2);
+  WriteLittleEndian(fp_, sample_rate_, 4);
+  WriteLittleEndian(fp_, sample_rate_ * block_align, 4);
+  WriteLittleEndian(fp_, block_align, 2);
+  WriteLittleEndian(fp_, bits_per_sample_, 2);
+  fwrite("data", 1, 4, fp_);
+  WriteLittleEndian(fp_, data_size, 4);
+}
+
+void WavWriter::Write(const uint8_t* frame) {
+  fwrite(frame, 1, num_channels_, fp_);
+  ++num_frames_;
+}
+
+void WavWriter::Write(const int16_t* frame) {
+  for (uint16_t i = 0; i < num_channels_; ++i) {
+    WriteLittleEndian(fp_, static_cast<uint16_t>(frame[i]), 2);
+  }
+  ++num_frames_;
+}
+
+void WavWriter::Close() {
+  if (fp_) {
+    fseek(fp_, 0, SEEK_SET);
+    WriteHeader();
+    fclose(fp_);
+    fp_ = NULL;
+  }
+}
+
+}  // namespace anu
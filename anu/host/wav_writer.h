@@ -0,0 +1,62 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Minimal writer for PCM WAV files. The sizes in the header are patched when
+// the file is closed.
+
+#ifndef ANU_HOST_WAV_WRITER_H_
+#define ANU_HOST_WAV_WRITER_H_
+
+#include "avrlib/base.h"
+
+#include <stdio.h>
+
+namespace anu {
+
+class WavWriter {
+ public:
+  WavWriter() : fp_(NULL) { }
+  ~WavWriter() { Close(); }
+  
+  // 8-bit samples are unsigned, 16-bit samples are signed.
+  bool Open(
+      const char* file_name,
+      uint16_t num_channels,
+      uint32_t sample_rate,
+      uint16_t bits_per_sample);
+  void Close();
+  
+  // Writes a frame of 8-bit samples.
+  void Write(const uint8_t* frame);
+  // Writes a frame of 16-bit samples.
+  void Write(const int16_t* frame);
+  
+ private:
+  void WriteHeader();
+  
+  FILE* fp_;
+  uint16_t num_channels_;
+  uint32_t sample_rate_;
+  uint16_t bits_per_sample_;
+  uint32_t num_frames_;
+  
+  DISALLOW_COPY_AND_ASSIGN(WavWriter);
+};
+
+}  // namespace anu
+
+#endif  // ANU_HOST_WAV_WRITER_H_
@@ -19,8 +19,6 @@
 
 #include "anu/midi_dispatcher.h"
 
-#include "anu/hardware_config.h"
-
 namespace anu {
 
 /* static */
@@ -30,21 +28,14 @@ bool MidiDispatcher::learning_midi_channel_ = false;
 bool MidiDispatcher::seen_midi_drum_events_ = false;
 
 /* static */
-void MidiDispatcher::Send(uint8_t status, uint8_t* data, uint8_t size) {
-  OutputBufferLowPriority::Overwrite(status);
-  if (size) {
-    OutputBufferLowPriority::Overwrite(*data++);
-    --size;
-  }
-  if (size) {
-    OutputBufferLowPriority::Overwrite(*data++);
-    --size;
-  }
-}
+MidiTimestamp MidiDispatcher::timestamp_;
 
 /* static */
-void MidiDispatcher::SendBlocking(uint8_t byte) {
-  OutputBufferLowPriority::Write(byte);
+uint8_t MidiDispatcher::running_status_ = 0;
+
+/* static */
+void MidiDispatcher::Send(uint8_t status, uint8_t* data, uint8_t size) {
+  midi_out_queue.Send(status, data, size);
 }
 
 /* static */
@@ -54,9 +45,7 @@ void MidiDispatcher::SendNow(uint8_t byte) {
 
 /* static */
 void MidiDispatcher::Send3(uint8_t status, uint8_t a, uint8_t b) {
-  OutputBufferLowPriority::Overwrite(status);
-  OutputBufferLowPriority::Overwrite(a);
-  OutputBufferLowPriority::Overwrite(b);
+  midi_out_queue.Send3(status, a, b);
 }
 
 /* extern */
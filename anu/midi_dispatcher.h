@@ -22,6 +22,7 @@
 #include "avrlib/ring_buffer.h"
 
 #include "anu/drum_synth.h"
+#include "anu/midi_out_queue.h"
 #include "anu/sysex_handler.h"
 #include "anu/system_settings.h"
 #include "anu/voice_controller.h"
@@ -30,14 +31,29 @@
 
 namespace anu {
 
-struct LowPriorityBufferSpecs {
+// Time of reception of a MIDI byte, captured by the UART receive interrupt:
+// the position in the audio stream (see AudioBuffer::read_position()) and
+// the number of DAC state samples played (see Voice::dac_timestamp()).
+struct MidiTimestamp {
+  uint8_t audio;
+  uint8_t dac;
+};
+
+struct TimestampedMidiByte {
+  uint8_t value;
+  MidiTimestamp timestamp;
+};
+
+struct MidiInBufferSpecs {
   enum {
-    buffer_size = 128,
+    buffer_size = 32,
     data_size = 8,
   };
-  typedef avrlib::DataTypeForSize<data_size>::Type Value;
+  typedef TimestampedMidiByte Value;
 };
 
+typedef avrlib::RingBuffer<MidiInBufferSpecs> MidiInBuffer;
+
 struct HighPriorityBufferSpecs {
   enum {
     buffer_size = 16,
@@ -48,16 +64,21 @@ struct HighPriorityBufferSpecs {
 
 class MidiDispatcher : public midi::MidiDevice {
  public:
-  typedef avrlib::RingBuffer<LowPriorityBufferSpecs> OutputBufferLowPriority;
   typedef avrlib::RingBuffer<HighPriorityBufferSpecs> OutputBufferHighPriority;
 
   MidiDispatcher() { }
 
   // ------ MIDI in handling ---------------------------------------------------
+  
+  // Timestamp of the byte about to be pushed to the parser. The events are
+  // played at a constant latency from the reception of their last byte.
+  static inline void set_timestamp(MidiTimestamp timestamp) {
+    timestamp_ = timestamp;
+  }
 
   // Forwarded to the controller.
   static inline void NoteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
-    voice_controller.NoteOn(note, velocity);
+    voice_controller.NoteOn(note, velocity, timestamp_.dac);
   }
   static inline void NoteOff(uint8_t channel, uint8_t note, uint8_t velocity) {
     voice_controller.NoteOff(note);
@@ -94,7 +115,7 @@ class MidiDispatcher : public midi::MidiDevice {
   static void OmniModeOn(uint8_t channel) { }
   
   static void ProgramChange(uint8_t channel, uint8_t program) {
-    // No fucking presets.
+    voice_controller.RecallProgram(program);
   }
   
   static void Reset() { }
@@ -154,11 +175,11 @@ class MidiDispatcher : public midi::MidiDevice {
       uint8_t velocity = data[1] << 1;
       if (velocity) {
         if (note == 36) {
-          drum_synth.Trigger(0, velocity);
+          drum_synth.Trigger(0, velocity, timestamp_.audio);
         } else if (note == 38) {
-          drum_synth.Trigger(1, velocity);
+          drum_synth.Trigger(1, velocity, timestamp_.audio);
         } else if (note == 42) {
-          drum_synth.Trigger(2, velocity);
+          drum_synth.Trigger(2, velocity, timestamp_.audio);
         }
         seen_midi_drum_events_ = true;
       }
@@ -185,16 +206,38 @@ class MidiDispatcher : public midi::MidiDevice {
     return OutputBufferHighPriority::readable();
   }
   
-  static uint8_t readable_low_priority() {
-    return OutputBufferLowPriority::readable();
-  }
-
   static uint8_t ImmediateReadHighPriority() {
     return OutputBufferHighPriority::ImmediateRead();
   }
   
-  static uint8_t ImmediateReadLowPriority() {
-    return OutputBufferLowPriority::ImmediateRead();
+  // Removes from the buffers the next byte to send to the MIDI out, and
+  // returns false if there is none. The high priority buffer is flushed
+  // first; its realtime bytes can be inserted within a message of the low
+  // priority queue. The status bytes of the channel messages which repeat the
+  // running status are not sent. Realtime messages can be interleaved anywhere
+  // without cancelling the running status, but any other system message
+  // cancels it.
+  static inline bool ReadOutput(uint8_t* byte) {
+    if (OutputBufferHighPriority::readable()) {
+      uint8_t value = OutputBufferHighPriority::ImmediateRead();
+      if (value < 0xf8) {
+        running_status_ = 0;
+      }
+      *byte = value;
+      return true;
+    }
+    uint8_t value;
+    while (midi_out_queue.ReadByte(&value)) {
+      if (value >= 0x80 && value < 0xf8) {
+        if (value == running_status_) {
+          continue;
+        }
+        running_status_ = value < 0xf0 ? value : 0;
+      }
+      *byte = value;
+      return true;
+    }
+    return false;
   }
   
   static void LearnChannel() {
@@ -218,7 +261,9 @@ class MidiDispatcher : public midi::MidiDevice {
     if (note != 0xff) {
       uint8_t channel = system_settings.midi_channel();
       if (mode() & MIDI_OUT_TX_GENERATED_MESSAGES) {
-        Send3(0x80 | channel, note, 0);
+        // Sent as a note on with a velocity of 0, to share the running
+        // status with the note ons.
+        Send3(0x90 | channel, note, 0);
       }
     }
   }
@@ -234,7 +279,7 @@ class MidiDispatcher : public midi::MidiDevice {
     if (note != 0xff) {
       if (mode() & MIDI_OUT_TX_GENERATED_DRUM_MESSAGES) {
         Send3(0x99, note, velocity);
-        Send3(0x89, note, 0);
+        Send3(0x99, note, 0);
       }
     }
   }
@@ -262,11 +307,13 @@ class MidiDispatcher : public midi::MidiDevice {
   }
   
   static void Send3(uint8_t status, uint8_t a, uint8_t b);
-  static void SendBlocking(uint8_t byte);
 
  private:
   static bool learning_midi_channel_;
   static bool seen_midi_drum_events_;
+  static MidiTimestamp timestamp_;
+  // Status of the last channel message sent to the MIDI out, 0 if none.
+  static uint8_t running_status_;
    
   static void Send(uint8_t status, uint8_t* data, uint8_t size);
   static void SendNow(uint8_t byte);
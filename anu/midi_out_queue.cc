@@ -0,0 +1,217 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Queue of the messages waiting to be sent by the low priority MIDI output.
+
+#include "anu/midi_out_queue.h"
+
+#include <avr/interrupt.h>
+
+#include "anu/performance_counters.h"
+
+namespace anu {
+
+/* static */
+MidiOutMessage MidiOutQueue::buffer_[kMidiOutQueueSize];
+
+/* static */
+volatile uint8_t MidiOutQueue::read_ptr_;
+
+/* static */
+volatile uint8_t MidiOutQueue::write_ptr_;
+
+/* static */
+uint8_t MidiOutQueue::system_size_;
+
+/* static */
+MidiOutSysExOwner MidiOutQueue::system_exclusive_owner_;
+
+/* static */
+bool MidiOutQueue::dropping_input_system_exclusive_;
+
+/* static */
+MidiOutMessage MidiOutQueue::held_[kMidiOutQueueNumHeldMessages];
+
+/* static */
+uint8_t MidiOutQueue::num_held_;
+
+/* static */
+MidiOutMessage MidiOutQueue::output_message_;
+
+/* static */
+uint8_t MidiOutQueue::output_index_;
+
+/* static */
+void MidiOutQueue::Init() {
+  read_ptr_ = 0;
+  write_ptr_ = 0;
+  system_size_ = 0;
+  system_exclusive_owner_ = MIDI_OUT_SYSEX_OWNER_NONE;
+  dropping_input_system_exclusive_ = false;
+  num_held_ = 0;
+  output_message_.size = 0;
+  output_index_ = 0;
+}
+
+/* static */
+void MidiOutQueue::Send(uint8_t status, const uint8_t* data, uint8_t size) {
+  if (status >= 0xf8) {
+    // The parser can report a realtime message received within another
+    // message with the data received so far. It has no data of its own.
+    PushRealtime(status);
+  } else if (size) {
+    Push(status, data[0], size >= 2 ? data[1] : 0, size + 1);
+  } else if (status == 0xf0 || status == 0xf7 || status < 0x80) {
+    ForwardSystem(status);
+  } else {
+    Push(status, 0, 0, 1);
+  }
+}
+
+/* static */
+void MidiOutQueue::Send3(uint8_t status, uint8_t a, uint8_t b) {
+  Push(status, a, b, 3);
+}
+
+/* static */
+void MidiOutQueue::SendSystem(uint8_t byte) {
+  PackSystem(byte, MIDI_OUT_SYSEX_OWNER_FIRMWARE);
+}
+
+/* static */
+void MidiOutQueue::ForwardSystem(uint8_t byte) {
+  // A message from the MIDI in can not be interleaved with a block of the
+  // firmware, and is too long to be held until its end.
+  if (byte == 0xf0) {
+    dropping_input_system_exclusive_ = \
+        system_exclusive_owner_ == MIDI_OUT_SYSEX_OWNER_FIRMWARE;
+    if (dropping_input_system_exclusive_) {
+      performance_counters.CountMidiOutDrop();
+    }
+  }
+  if (dropping_input_system_exclusive_) {
+    dropping_input_system_exclusive_ = byte != 0xf7;
+  } else if (byte == 0xf0 ||
+             system_exclusive_owner_ == MIDI_OUT_SYSEX_OWNER_MIDI_IN) {
+    // Only the bytes of a system exclusive message are packed.
+    PackSystem(byte, MIDI_OUT_SYSEX_OWNER_MIDI_IN);
+  }
+}
+
+/* static */
+void MidiOutQueue::PackSystem(uint8_t byte, MidiOutSysExOwner owner) {
+  if (system_size_ || writable()) {
+    buffer_[write_ptr_].bytes[system_size_++] = byte;
+    if (system_size_ == 3 || byte == 0xf7) {
+      FlushSystem();
+    }
+  } else {
+    performance_counters.CountMidiOutDrop();
+  }
+  if (byte == 0xf0) {
+    system_exclusive_owner_ = owner;
+  } else if (byte == 0xf7) {
+    system_exclusive_owner_ = MIDI_OUT_SYSEX_OWNER_NONE;
+    for (uint8_t i = 0; i < num_held_; ++i) {
+      const MidiOutMessage& message = held_[i];
+      Push(message.bytes[0], message.bytes[1], message.bytes[2], message.size);
+    }
+    num_held_ = 0;
+  }
+}
+
+/* static */
+void MidiOutQueue::PushRealtime(uint8_t byte) {
+  // A realtime message can be sent within a system exclusive message, so it
+  // goes right after the system exclusive data queued so far.
+  FlushSystem();
+  uint8_t w = write_ptr_;
+  if (!writable()) {
+    performance_counters.CountMidiOutDrop();
+    return;
+  }
+  MidiOutMessage* message = &buffer_[w];
+  message->size = 1;
+  message->bytes[0] = byte;
+  write_ptr_ = (w + 1) & (kMidiOutQueueSize - 1);
+}
+
+/* static */
+bool MidiOutQueue::Coalesce(
+    uint8_t status,
+    uint8_t controller,
+    uint8_t value) {
+  uint8_t w = write_ptr_;
+  for (uint8_t i = read_ptr_; i != w; i = (i + 1) & (kMidiOutQueueSize - 1)) {
+    MidiOutMessage* message = &buffer_[i];
+    if (message->size == 3 && message->bytes[0] == status &&
+        message->bytes[1] == controller) {
+      // The interrupt might have taken the message since the scan started.
+      cli();
+      uint8_t r = read_ptr_;
+      bool queued = ((i - r) & (kMidiOutQueueSize - 1)) <
+          ((w - r) & (kMidiOutQueueSize - 1));
+      if (queued) {
+        message->bytes[2] = value;
+      }
+      sei();
+      if (queued) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/* static */
+void MidiOutQueue::Push(uint8_t status, uint8_t a, uint8_t b, uint8_t size) {
+  uint8_t type = status & 0xf0;
+  bool note_off = type == 0x80 || (type == 0x90 && !b);
+  if (system_exclusive()) {
+    if (note_off && num_held_ < kMidiOutQueueNumHeldMessages) {
+      MidiOutMessage* message = &held_[num_held_++];
+      message->size = size;
+      message->bytes[0] = status;
+      message->bytes[1] = a;
+      message->bytes[2] = b;
+    } else {
+      performance_counters.CountMidiOutDrop();
+    }
+    return;
+  }
+  FlushSystem();
+  if (type == 0xb0 && coalescable(a) && Coalesce(status, a, b)) {
+    return;
+  }
+  uint8_t available = writable();
+  if (!available || (!note_off && available <= kMidiOutQueueReserve)) {
+    performance_counters.CountMidiOutDrop();
+    return;
+  }
+  uint8_t w = write_ptr_;
+  MidiOutMessage* message = &buffer_[w];
+  message->size = size;
+  message->bytes[0] = status;
+  message->bytes[1] = a;
+  message->bytes[2] = b;
+  write_ptr_ = (w + 1) & (kMidiOutQueueSize - 1);
+}
+
+/* extern */
+MidiOutQueue midi_out_queue;
+
+}  // namespace anu
@@ -0,0 +1,142 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Queue of the messages waiting to be sent by the low priority MIDI output.
+//
+// The messages are queued whole rather than as a stream of bytes, so a full
+// queue never corrupts a message: the new message is dropped, and counted,
+// instead. The last kMidiOutQueueReserve entries are kept for the note offs
+// and the system exclusive data, so that a busy output does not leave stuck
+// notes or truncated dumps downstream. A control change for a continuous
+// controller replaces the value of a queued control change for the same
+// controller, if it has not been sent yet. The bytes of system exclusive data
+// are packed 3 per entry; the other system messages are queued at once, in an
+// entry of their own.
+//
+// Channel messages cannot be sent within a system exclusive message. While
+// one is being queued, the note offs are held until its end, and the other
+// channel messages are dropped. A system exclusive message forwarded from the
+// MIDI in while a block of the firmware is being queued is dropped whole.
+
+#ifndef ANU_MIDI_OUT_QUEUE_H_
+#define ANU_MIDI_OUT_QUEUE_H_
+
+#include "avrlib/base.h"
+
+namespace anu {
+
+enum MidiOutSysExOwner {
+  MIDI_OUT_SYSEX_OWNER_NONE,
+  MIDI_OUT_SYSEX_OWNER_FIRMWARE,
+  MIDI_OUT_SYSEX_OWNER_MIDI_IN
+};
+
+struct MidiOutMessage {
+  uint8_t size;
+  uint8_t bytes[3];
+};
+
+static const uint8_t kMidiOutQueueSize = 32;
+static const uint8_t kMidiOutQueueReserve = 8;
+static const uint8_t kMidiOutQueueNumHeldMessages = 4;
+
+class MidiOutQueue {
+ public:
+  MidiOutQueue() { }
+  
+  static void Init();
+  
+  // Called by the main loop.
+  static void Send(uint8_t status, const uint8_t* data, uint8_t size);
+  static void Send3(uint8_t status, uint8_t a, uint8_t b);
+  // A byte of a system exclusive block sent by the firmware.
+  static void SendSystem(uint8_t byte);
+  
+  static inline uint8_t writable() {
+    return (read_ptr_ - write_ptr_ - 1) & (kMidiOutQueueSize - 1);
+  }
+  
+  static inline bool system_exclusive() {
+    return system_exclusive_owner_ != MIDI_OUT_SYSEX_OWNER_NONE;
+  }
+  
+  // Called by the MIDI out interrupt. Returns the bytes of the queued
+  // messages one at a time, and false when there is none left.
+  static inline bool ReadByte(uint8_t* byte) {
+    if (output_index_ == output_message_.size) {
+      uint8_t r = read_ptr_;
+      if (r == write_ptr_) {
+        return false;
+      }
+      output_message_ = buffer_[r];
+      output_index_ = 0;
+      read_ptr_ = (r + 1) & (kMidiOutQueueSize - 1);
+    }
+    *byte = output_message_.bytes[output_index_++];
+    return true;
+  }
+  
+ private:
+  // The values of the bank select, data entry, (N)RPN and channel mode
+  // controllers are meaningful only in sequence, so they are never replaced.
+  static inline bool coalescable(uint8_t controller) {
+    return controller != 0 && controller != 6 && controller != 32 &&
+        controller != 38 && (controller < 96 || controller > 101) &&
+        controller < 120;
+  }
+  static bool Coalesce(uint8_t status, uint8_t controller, uint8_t value);
+  static void Push(uint8_t status, uint8_t a, uint8_t b, uint8_t size);
+  static void PushRealtime(uint8_t byte);
+  static void ForwardSystem(uint8_t byte);
+  static void PackSystem(uint8_t byte, MidiOutSysExOwner owner);
+  static inline void FlushSystem() {
+    if (system_size_) {
+      uint8_t w = write_ptr_;
+      buffer_[w].size = system_size_;
+      write_ptr_ = (w + 1) & (kMidiOutQueueSize - 1);
+      system_size_ = 0;
+    }
+  }
+  
+  static MidiOutMessage buffer_[kMidiOutQueueSize];
+  static volatile uint8_t read_ptr_;
+  static volatile uint8_t write_ptr_;
+  
+  // Number of bytes of system exclusive data in the entry at write_ptr_,
+  // which is not yet handed to the interrupt.
+  static uint8_t system_size_;
+  // Source of the system exclusive message being queued.
+  static MidiOutSysExOwner system_exclusive_owner_;
+  // A system exclusive message from the MIDI in is being dropped.
+  static bool dropping_input_system_exclusive_;
+  
+  // Note offs sent while a system exclusive message is being queued.
+  static MidiOutMessage held_[kMidiOutQueueNumHeldMessages];
+  static uint8_t num_held_;
+  
+  // Message being sent by the interrupt.
+  static MidiOutMessage output_message_;
+  static uint8_t output_index_;
+  
+  DISALLOW_COPY_AND_ASSIGN(MidiOutQueue);
+};
+
+extern MidiOutQueue midi_out_queue;
+
+}  // namespace anu
+
+#endif  // ANU_MIDI_OUT_QUEUE_H_
@@ -26,12 +26,17 @@
 // player releases C5 -> G4 is played.
 // player releases G4 -> C4 is played.
 //
-// The nodes used in the linked list are pre-allocated from a pool of 16
+// The nodes used in the linked list are pre-allocated from a pool of up to 16
 // nodes, so the "pointers" (to the root element for example) are not actual
-// pointers, but indices of an element in the pool.
+// pointers, but indices of an element in the pool. The list is doubly linked,
+// so a note is removed, and the least recent note found, without walking it.
+// The free nodes are given by a bitmask.
 //
 // Additionally, an array of pointers is stored to allow random access to the
-// n-th note, sorted by ascending order of pitch (for arpeggiation).
+// n-th note, sorted by ascending order of pitch (for arpeggiation). It is
+// also searched by bisection to find the node of a note. A bitmap of the
+// notes in the stack saves this search for the notes which are not pressed,
+// such as the one checked before each note on.
 
 #ifndef ANU_NOTE_STACK_H_
 #define ANU_NOTE_STACK_H_
@@ -55,7 +60,10 @@ template<uint8_t capacity>
 class NoteStack {
  public: 
   NoteStack() { }
-  void Init() { Clear(); }
+  void Init() {
+    STATIC_ASSERT(capacity <= 16);
+    Clear();
+  }
 
   void NoteOn(uint8_t note, uint8_t velocity) {
     // Remove the note from the list first (in case it is already here).
@@ -63,79 +71,80 @@ class NoteStack {
     // In case of saturation, remove the least recently played note from the
     // stack.
     if (size_ == capacity) {
-      uint8_t least_recent_note;
-      for (uint8_t i = 1; i <= capacity; ++i) {
-        if (pool_[i].next_ptr == 0) {
-          least_recent_note = pool_[i].note;
-        }
-      }
-      NoteOff(least_recent_note);
+      NoteOff(pool_[tail_ptr_].note);
     }
-    // Now we are ready to insert the new note. Find a free slot to insert it.
-    uint8_t free_slot;
-    for (uint8_t i = 1; i <= capacity; ++i) {
-      if (pool_[i].note == kFreeSlot) {
-        free_slot = i;
-        break;
-      }
+    // Now we are ready to insert the new note. Take the first free slot.
+    uint8_t free_slot = 1;
+    uint16_t free_slots = free_slots_;
+    while (!(free_slots & 1)) {
+      free_slots >>= 1;
+      ++free_slot;
     }
+    free_slots_ &= ~(1U << (free_slot - 1));
     pool_[free_slot].next_ptr = root_ptr_;
     pool_[free_slot].note = note;
     pool_[free_slot].velocity = velocity;
+    previous_ptr_[free_slot] = 0;
+    if (root_ptr_) {
+      previous_ptr_[root_ptr_] = free_slot;
+    } else {
+      tail_ptr_ = free_slot;
+    }
     root_ptr_ = free_slot;
+    notes_[(note >> 3) & 0x0f] |= 1 << (note & 0x07);
     // The last step consists in inserting the note in the sorted list.
-    for (uint8_t i = 0; i < size_; ++i) {
-      if (pool_[sorted_ptr_[i]].note > note) {
-        for (uint8_t j = size_; j > i; --j) {
-          sorted_ptr_[j] = sorted_ptr_[j - 1];
-        }
-        sorted_ptr_[i] = free_slot;
-        free_slot = 0;
-        break;
-      }
-    }
-    if (free_slot) {
-      sorted_ptr_[size_] = free_slot;
-    }
+    uint8_t position = sorted_position(note);
+    memmove(
+        sorted_ptr_ + position + 1,
+        sorted_ptr_ + position,
+        size_ - position);
+    sorted_ptr_[position] = free_slot;
     ++size_;
   }
   
   void NoteOff(uint8_t note) {
-    uint8_t current = root_ptr_;
-    uint8_t previous = 0;
-    while (current) {
-     if (pool_[current].note == note) {
-       break;
-     }
-     previous = current;
-     current = pool_[current].next_ptr;
+    uint8_t mask = 1 << (note & 0x07);
+    uint8_t* notes = &notes_[(note >> 3) & 0x0f];
+    if (!(*notes & mask)) {
+      return;
+    }
+    uint8_t position = sorted_position(note);
+    uint8_t current = sorted_ptr_[position];
+    if (position == size_ || pool_[current].note != note) {
+      return;
     }
-    if (current) {
-     if (previous) {
-       pool_[previous].next_ptr = pool_[current].next_ptr;
-     } else {
-       root_ptr_ = pool_[current].next_ptr;
-     }
-     for (uint8_t i = 0; i < size_; ++i) {
-       if (sorted_ptr_[i] == current) {
-         for (uint8_t j = i; j < size_ - 1; ++j) {
-           sorted_ptr_[j] = sorted_ptr_[j + 1];
-         }
-         break;
-       }
-     }
-     pool_[current].next_ptr = 0;
-     pool_[current].note = kFreeSlot;
-     pool_[current].velocity = 0;
-     --size_;
+    *notes &= ~mask;
+    uint8_t previous = previous_ptr_[current];
+    uint8_t next = pool_[current].next_ptr;
+    if (previous) {
+      pool_[previous].next_ptr = next;
+    } else {
+      root_ptr_ = next;
     }
+    if (next) {
+      previous_ptr_[next] = previous;
+    } else {
+      tail_ptr_ = previous;
+    }
+    --size_;
+    memmove(
+        sorted_ptr_ + position,
+        sorted_ptr_ + position + 1,
+        size_ - position);
+    pool_[current].next_ptr = 0;
+    pool_[current].note = kFreeSlot;
+    pool_[current].velocity = 0;
+    free_slots_ |= 1U << (current - 1);
   }
   
   void Clear() {
     size_ = 0;
     memset(pool_ + 1, 0, sizeof(NoteEntry) * capacity);
     memset(sorted_ptr_ + 1, 0, capacity);
+    memset(notes_, 0, sizeof(notes_));
     root_ptr_ = 0;
+    tail_ptr_ = 0;
+    free_slots_ = 0xffff >> (16 - capacity);
     for (uint8_t i = 0; i <= capacity; ++i) {
       pool_[i].note = kFreeSlot;
     }
@@ -143,18 +152,11 @@ class NoteStack {
 
   uint8_t size() const { return size_; }
   const NoteEntry& most_recent_note() const { return pool_[root_ptr_]; }
-  const NoteEntry& least_recent_note() const {
-    uint8_t current = root_ptr_;
-    while (current && pool_[current].next_ptr) {
-      current = pool_[current].next_ptr;
-    }
-    return pool_[current];
-  }
+  const NoteEntry& least_recent_note() const { return pool_[tail_ptr_]; }
   const NoteEntry& played_note(uint8_t index) const {
-    uint8_t current = root_ptr_;
-    index = size_ - index - 1;
+    uint8_t current = tail_ptr_;
     for (uint8_t i = 0; i < index; ++i) {
-      current = pool_[current].next_ptr;
+      current = previous_ptr_[current];
     }
     return pool_[current];
   }
@@ -165,10 +167,30 @@ class NoteStack {
   const NoteEntry& dummy() const { return pool_[0]; }
 
  private:
+  // Position of the first note which is not lower than note, in the sorted
+  // list.
+  uint8_t sorted_position(uint8_t note) const {
+    uint8_t low = 0;
+    uint8_t high = size_;
+    while (low < high) {
+      uint8_t middle = (low + high) >> 1;
+      if (pool_[sorted_ptr_[middle]].note < note) {
+        low = middle + 1;
+      } else {
+        high = middle;
+      }
+    }
+    return low;
+  }
+  
   uint8_t size_;
   NoteEntry pool_[capacity + 1];  // First element is a dummy node!
   uint8_t root_ptr_;  // Base 1.
+  uint8_t tail_ptr_;  // Base 1.
+  uint8_t previous_ptr_[capacity + 1];  // Base 1.
   uint8_t sorted_ptr_[capacity + 1];  // Base 1.
+  uint16_t free_slots_;  // Bit i for the slot i + 1.
+  uint8_t notes_[16];  // Bit i of byte j for the note 8 * j + i.
 
   DISALLOW_COPY_AND_ASSIGN(NoteStack);
 };
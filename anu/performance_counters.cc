@@ -0,0 +1,34 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// CPU load meter and buffer underrun counters.
+
+#include "anu/performance_counters.h"
+
+namespace anu {
+
+/* <static> */
+PerformanceCountersData PerformanceCounters::data_;
+volatile bool PerformanceCounters::main_loop_busy_;
+uint16_t PerformanceCounters::busy_samples_;
+uint16_t PerformanceCounters::window_counter_;
+/* </static> */
+
+/* extern */
+PerformanceCounters performance_counters;
+
+}  // namespace anu
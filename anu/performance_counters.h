@@ -0,0 +1,96 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// CPU load meter and buffer underrun counters.
+//
+// The load is measured statistically: the main loop flags itself as busy
+// when it has samples to render or MIDI data to parse, and the DAC interrupt
+// samples this flag. The busy ratio is latched every kLoadWindowSize samples
+// (0.84s) as a 0-255 value.
+
+#ifndef ANU_PERFORMANCE_COUNTERS_H_
+#define ANU_PERFORMANCE_COUNTERS_H_
+
+#include "avrlib/base.h"
+
+#include <string.h>
+
+namespace anu {
+
+static const uint16_t kLoadWindowSize = 4096;
+
+struct PerformanceCountersData {
+  uint8_t cpu_load;
+  uint8_t peak_cpu_load;
+  uint16_t audio_underruns;
+  uint16_t dac_underruns;
+  uint16_t midi_in_overruns;
+  uint16_t midi_out_drops;
+};
+
+class PerformanceCounters {
+ public:
+  PerformanceCounters() { }
+  
+  static void Init() {
+    memset(&data_, 0, sizeof(data_));
+    main_loop_busy_ = false;
+    busy_samples_ = 0;
+    window_counter_ = 0;
+  }
+  
+  static inline void set_main_loop_busy(bool busy) {
+    main_loop_busy_ = busy;
+  }
+  
+  static inline void Sample() {
+    if (main_loop_busy_) {
+      ++busy_samples_;
+    }
+    if (++window_counter_ == kLoadWindowSize) {
+      uint16_t load = busy_samples_ >> 4;
+      data_.cpu_load = load > 255 ? 255 : load;
+      if (data_.cpu_load > data_.peak_cpu_load) {
+        data_.peak_cpu_load = data_.cpu_load;
+      }
+      busy_samples_ = 0;
+      window_counter_ = 0;
+    }
+  }
+  
+  static inline void CountAudioUnderrun() { ++data_.audio_underruns; }
+  static inline void CountDACUnderrun() { ++data_.dac_underruns; }
+  static inline void CountMidiInOverrun() { ++data_.midi_in_overruns; }
+  static inline void CountMidiOutDrop() { ++data_.midi_out_drops; }
+  
+  static inline PerformanceCountersData* mutable_data() { return &data_; }
+  static inline const PerformanceCountersData& data() { return data_; }
+
+ private:
+  static PerformanceCountersData data_;
+  static volatile bool main_loop_busy_;
+  static uint16_t busy_samples_;
+  static uint16_t window_counter_;
+  
+  DISALLOW_COPY_AND_ASSIGN(PerformanceCounters);
+};
+
+extern PerformanceCounters performance_counters;
+
+}  // namespace anu
+
+#endif // ANU_PERFORMANCE_COUNTERS_H_
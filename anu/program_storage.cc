@@ -0,0 +1,156 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Slots of the EEPROM holding programs.
+
+#include "anu/program_storage.h"
+
+#include "anu/eeprom_writer.h"
+#include "anu/storage.h"
+
+namespace anu {
+
+/* static */
+uint8_t ProgramStorage::directory_[kNumPrograms];
+
+/* static */
+uint8_t ProgramStorage::stored_program_;
+
+/* static */
+uint8_t ProgramStorage::stored_entry_;
+
+/* static */
+void ProgramStorage::Init() {
+  STATIC_ASSERT(kProgramBlocksAddress + \
+      kNumProgramBlocks * kProgramBlockSize <= 1000);
+  STATIC_ASSERT(kProgramMaxSize <= 7 * kProgramBlockSize);
+  
+  for (uint8_t i = 0; i < kNumPrograms; ++i) {
+    uint8_t* entry = &directory_[i];
+    if (!storage.Read(entry, directory_address(i), 1) ||
+        !(*entry & 0x07) ||
+        (*entry >> 3) + (*entry & 0x07) > kNumProgramBlocks) {
+      *entry = kProgramEmpty;
+    }
+  }
+  stored_program_ = kNumPrograms;
+}
+
+/* static */
+void ProgramStorage::UpdateDirectory() {
+  // The directory entry is the last request of a store, so all the blocks
+  // have been written once the writer is idle.
+  if (stored_program_ != kNumPrograms && !eeprom_writer.busy()) {
+    directory_[stored_program_] = stored_entry_;
+    stored_program_ = kNumPrograms;
+  }
+}
+
+/* static */
+uint32_t ProgramStorage::used_blocks(uint8_t entry) {
+  if (entry == kProgramEmpty) {
+    return 0;
+  }
+  return ((1UL << (entry & 0x07)) - 1) << (entry >> 3);
+}
+
+/* static */
+uint8_t ProgramStorage::Allocate(uint32_t used_blocks, uint8_t num_blocks) {
+  uint32_t mask = (1UL << num_blocks) - 1;
+  for (uint8_t i = 0; i + num_blocks <= kNumProgramBlocks; ++i) {
+    if (!(used_blocks & mask)) {
+      return i;
+    }
+    mask <<= 1;
+  }
+  return kNumProgramBlocks;
+}
+
+/* static */
+bool ProgramStorage::Store(
+    uint8_t program,
+    const Patch& patch,
+    const SequencerSettings& settings,
+    const Sequence& sequence) {
+  // The four requests of a program are queued at once, in an idle EEPROM
+  // writer, so that they never fill its queue.
+  if (eeprom_writer.busy()) {
+    return false;
+  }
+  UpdateDirectory();
+  
+  // The packed size of the sequence is clamped, in case its size has been
+  // received by SysEx and is out of range.
+  uint16_t size = sizeof(Patch) + 1 + sizeof(SequencerSettings) + 1 + \
+      sequence.packed_size() + 1;
+  uint8_t num_blocks = (size + kProgramBlockSize - 1) / kProgramBlockSize;
+  
+  uint32_t used = 0;
+  for (uint8_t i = 0; i < kNumPrograms; ++i) {
+    if (i != program) {
+      used |= used_blocks(directory_[i]);
+    }
+  }
+  
+  // Leave the previous version of the program untouched if possible.
+  uint8_t first = Allocate(
+      used | used_blocks(directory_[program]),
+      num_blocks);
+  if (first == kNumProgramBlocks) {
+    first = Allocate(used, num_blocks);
+    if (first == kNumProgramBlocks) {
+      return false;
+    }
+  }
+  
+  uint8_t* address = block_address(first);
+  storage.Save(&patch, address, sizeof(Patch));
+  address += sizeof(Patch) + 1;
+  storage.Save(&settings, address, sizeof(SequencerSettings));
+  address += sizeof(SequencerSettings) + 1;
+  storage.Save(&sequence, address, sequence.packed_size());
+  
+  stored_program_ = program;
+  stored_entry_ = (first << 3) | num_blocks;
+  storage.Save(&stored_entry_, directory_address(program), 1);
+  return true;
+}
+
+/* static */
+bool ProgramStorage::Recall(
+    uint8_t program,
+    Patch* patch,
+    SequencerSettings* settings,
+    Sequence* sequence) {
+  UpdateDirectory();
+  uint8_t entry = directory_[program];
+  if (entry == kProgramEmpty) {
+    return false;
+  }
+  const uint8_t* address = block_address(entry >> 3);
+  bool valid = storage.Read(patch, address, sizeof(Patch));
+  address += sizeof(Patch) + 1;
+  valid = storage.Read(settings, address, sizeof(SequencerSettings)) && valid;
+  address += sizeof(SequencerSettings) + 1;
+  
+  return ReadSequence(sequence, address) && valid;
+}
+
+/* extern */
+ProgramStorage program_storage;
+
+}  // namespace anu
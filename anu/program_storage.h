@@ -0,0 +1,126 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Slots of the EEPROM holding programs - a patch, the sequencer settings and
+// a sequence - recalled by Program Change messages.
+//
+// The programs are stored in a pool of blocks, and take as many consecutive
+// blocks as needed by the length of their sequence. A directory gives, for
+// each program, its first block and its number of blocks, in a single byte
+// followed by its checksum. The directory is kept in memory, so a recall
+// only reads the stored program: at most kProgramMaxSize bytes, with no
+// search.
+//
+// Layout of a program, each part followed by its checksum:
+// - the patch,
+// - the sequencer settings,
+// - the sequence, without the unused part of its data.
+//
+// A program is written in other blocks than the ones it occupies, when there
+// is room for it, and its directory entry is written last. A store
+// interrupted by a power loss thus leaves the previous version of the
+// program. The directory in memory is updated once the EEPROM writer is
+// done, so the program is not recalled before it has been written.
+
+#ifndef ANU_PROGRAM_STORAGE_H_
+#define ANU_PROGRAM_STORAGE_H_
+
+#include "avrlib/base.h"
+
+#include "anu/voice.h"
+#include "anu/voice_controller.h"
+
+namespace anu {
+
+// The directory is between the sequencer settings (192) and the sequence
+// (256), and the blocks between the sequence and the settings saved by the
+// previous versions of the firmware (1000).
+static const uint8_t kNumPrograms = 16;
+static const uint8_t kNumProgramBlocks = 18;
+static const uint8_t kProgramBlockSize = 32;
+static const uint16_t kProgramDirectoryAddress = 217;
+static const uint16_t kProgramBlocksAddress = 418;
+
+static const uint8_t kProgramEmpty = 0xff;
+
+static const uint16_t kProgramFixedSize = \
+    sizeof(Patch) + 1 + \
+    sizeof(SequencerSettings) + 1 + \
+    sizeof(Sequence) - kSequenceDataSize + 1;
+static const uint16_t kProgramMaxSize = kProgramFixedSize + kSequenceDataSize;
+
+class ProgramStorage {
+ public:
+  ProgramStorage() { }
+  
+  static void Init();
+  
+  static inline bool empty(uint8_t program) {
+    UpdateDirectory();
+    return directory_[program] == kProgramEmpty;
+  }
+  
+  // Queues the program for writing. The data is read by the EEPROM writer,
+  // and must stay in memory - and not be replaced by another program - until
+  // it is done. Returns false if there is no
+  // room left for the program, or if the EEPROM writer is still busy.
+  static bool Store(
+      uint8_t program,
+      const Patch& patch,
+      const SequencerSettings& settings,
+      const Sequence& sequence);
+  
+  // Reads the program in place. Returns false if one of its checksums is
+  // invalid, in which case the data is left partially overwritten. Must only
+  // be called while the EEPROM writer is idle, since the interrupt starting
+  // a write could corrupt a read.
+  static bool Recall(
+      uint8_t program,
+      Patch* patch,
+      SequencerSettings* settings,
+      Sequence* sequence);
+  
+ private:
+  // Moves the entry of the program being stored to the directory, once the
+  // EEPROM writer is done with it.
+  static void UpdateDirectory();
+  static uint32_t used_blocks(uint8_t entry);
+  static uint8_t Allocate(uint32_t used_blocks, uint8_t num_blocks);
+  
+  static inline uint8_t* block_address(uint8_t block) {
+    return (uint8_t*)(kProgramBlocksAddress) + block * kProgramBlockSize;
+  }
+  
+  static inline uint8_t* directory_address(uint8_t program) {
+    return (uint8_t*)(kProgramDirectoryAddress) + program * 2;
+  }
+  
+  // First block in the 5 upper bits, number of blocks in the 3 lower bits.
+  static uint8_t directory_[kNumPrograms];
+  
+  // Program being stored (kNumPrograms if none), and its directory entry.
+  static uint8_t stored_program_;
+  static uint8_t stored_entry_;
+  
+  DISALLOW_COPY_AND_ASSIGN(ProgramStorage);
+};
+
+extern ProgramStorage program_storage;
+
+}  // namespace anu
+
+#endif  // ANU_PROGRAM_STORAGE_H_
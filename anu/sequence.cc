@@ -0,0 +1,205 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Packed step sequence.
+
+#include "anu/sequence.h"
+
+#include <avr/eeprom.h>
+
+#include "anu/storage.h"
+
+namespace anu {
+
+bool ReadSequence(Sequence* sequence, const uint8_t* address) {
+  uint8_t size = eeprom_read_byte(address + 1);
+  if (size > kSequenceDataSize) {
+    return false;
+  }
+  if (!storage.Read(sequence, address, size + 2)) {
+    return false;
+  }
+  
+  // The checksum of a sequence saved in the unpacked format by the previous
+  // versions of the firmware can match by chance.
+  const uint8_t* data = sequence->data;
+  uint16_t num_notes = 0;
+  uint8_t position = 0;
+  while (position < size) {
+    uint8_t code = data[position++];
+    if (code >= 0xc0) {
+      num_notes += (code & 0x1f) + 1;
+    } else {
+      if (code >= 0x80 && (position == size || data[position++] >= 0x80)) {
+        return false;
+      }
+      ++num_notes;
+    }
+  }
+  return num_notes == sequence->num_notes;
+}
+
+bool ReadLegacySequence(Sequence* sequence, const uint8_t* address) {
+  uint8_t num_notes = eeprom_read_byte(address);
+  if (num_notes > kLegacySequenceLength) {
+    return false;
+  }
+  uint8_t checksum = 0;
+  for (uint8_t i = 0; i < kLegacySequenceSize; ++i) {
+    uint8_t byte = eeprom_read_byte(address + i);
+    if (i && i <= num_notes && byte >= 0x80 && byte < kSequenceTie) {
+      return false;
+    }
+    checksum += byte;
+  }
+  if (eeprom_read_byte(address + kLegacySequenceSize) != checksum) {
+    return false;
+  }
+  
+  SequenceWriter writer;
+  writer.Init(sequence);
+  for (uint8_t i = 0; i < num_notes && !writer.full(); ++i) {
+    writer.AppendStep(eeprom_read_byte(address + 1 + i));
+  }
+  uint8_t flags[2 * kLegacySequenceFlagsSize];
+  eeprom_read_block(flags, address + 1 + kLegacySequenceLength, sizeof(flags));
+  SetLegacySequenceFlags(sequence, flags, flags + kLegacySequenceFlagsSize);
+  return true;
+}
+
+void SetLegacySequenceFlags(
+    Sequence* sequence,
+    const uint8_t* accents,
+    const uint8_t* slides) {
+  uint8_t* data = sequence->data;
+  uint8_t size = sequence->packed_size() - 2;
+  uint8_t position = 0;
+  uint8_t step = 0;
+  while (position < size && step < kLegacySequenceLength) {
+    uint8_t code = data[position];
+    uint8_t mask = 1 << (step & 7);
+    uint8_t flags = 0;
+    if (accents[step >> 3] & mask) {
+      flags |= SEQUENCE_FLAG_ACCENT;
+    }
+    if (slides[step >> 3] & mask) {
+      flags |= SEQUENCE_FLAG_SLIDE;
+    }
+    if (code < 0x80) {
+      data[position] = code | flags;
+      position += 1;
+      ++step;
+    } else if (code < 0xc0) {
+      data[position] = code | (flags >> 1);
+      position += 2;
+      ++step;
+    } else {
+      position += 1;
+      step += (code & 0x1f) + 1;
+    }
+  }
+}
+
+void SequenceWriter::Init(Sequence* sequence) {
+  sequence_ = sequence;
+  sequence_->num_notes = 0;
+  sequence_->size = 0;
+  note_ = kSequenceReferenceNote;
+  flags_ = 0;
+}
+
+void SequenceWriter::AppendNote(uint8_t note) {
+  uint8_t* data = &sequence_->data[sequence_->size];
+  int8_t delta = note - note_;
+  if (delta >= -16 && delta < 16) {
+    data[0] = flags_ | (delta & 0x1f);
+    sequence_->size += 1;
+  } else {
+    data[0] = 0x80 | (flags_ >> 1);
+    data[1] = note;
+    sequence_->size += 2;
+  }
+  note_ = note;
+  flags_ = 0;
+  ++sequence_->num_notes;
+}
+
+void SequenceWriter::AppendStep(uint8_t note) {
+  if (note == kSequenceRest) {
+    AppendRest();
+  } else if (note == kSequenceTie) {
+    AppendTie();
+  } else {
+    AppendNote(note & 0x7f);
+  }
+}
+
+void SequenceWriter::AppendRun(uint8_t code) {
+  // Extend the previous run if it is of the same type. The last byte can
+  // not be mistaken for a run when it is the note of a 2-byte code, since
+  // notes are below 0x80.
+  uint8_t size = sequence_->size;
+  uint8_t last = size ? sequence_->data[size - 1] : 0;
+  if ((last & 0xe0) == code && (last & 0x1f) != 0x1f) {
+    ++sequence_->data[size - 1];
+  } else {
+    sequence_->data[size] = code;
+    sequence_->size = size + 1;
+  }
+  flags_ = 0;
+  ++sequence_->num_notes;
+}
+
+SequenceStep SequenceReader::Next() {
+  SequenceStep step;
+  step.flags = 0;
+  if (run_length_) {
+    --run_length_;
+    step.note = run_note_;
+    return step;
+  }
+  
+  const uint8_t* data = sequence_->data;
+  uint8_t size = sequence_->size;
+  if (size > kSequenceDataSize) {
+    size = kSequenceDataSize;
+  }
+  if (position_ >= size) {
+    step.note = kSequenceRest;
+    return step;
+  }
+  
+  uint8_t code = data[position_++];
+  if (code < 0x80) {
+    // Sign-extend the 5-bit interval.
+    note_ += static_cast<int8_t>(code << 3) >> 3;
+    step.flags = code & (SEQUENCE_FLAG_ACCENT | SEQUENCE_FLAG_SLIDE);
+  } else if (code < 0xc0) {
+    note_ = position_ < size ? data[position_++] : kSequenceReferenceNote;
+    step.flags = (code << 1) & (SEQUENCE_FLAG_ACCENT | SEQUENCE_FLAG_SLIDE);
+  } else {
+    run_note_ = code & 0x20 ? kSequenceTie : kSequenceRest;
+    run_length_ = code & 0x1f;
+    step.note = run_note_;
+    return step;
+  }
+  note_ &= 0x7f;
+  step.note = note_;
+  return step;
+}
+
+}  // namespace anu
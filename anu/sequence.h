@@ -0,0 +1,164 @@
+// Copyright 2012 Emilie Gillet.
+//
+// Author: Emilie Gillet (emilie.o.gillet@gmail.com)
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// -----------------------------------------------------------------------------
+//
+// Packed step sequence.
+//
+// The steps are stored as a stream of variable-length codes:
+// - 0ASddddd: note, at d semitones (-16 to 15) from the previous note.
+// - 10AS0000 0nnnnnnn: note n.
+// - 110ccccc: run of c + 1 rests.
+// - 111ccccc: run of c + 1 ties.
+// A and S are the accent and slide flags of the note. The first note is
+// relative to kSequenceReferenceNote.
+//
+// A melodic line takes one byte per note, and a run of rests or ties takes
+// one byte, so the sequence is much smaller than with a byte per step and
+// separate bitmaps of accents and slides. The steps are appended by a
+// SequenceWriter while the sequence is recorded, and read in order by a
+// SequenceReader while it is played.
+
+#ifndef ANU_SEQUENCE_H_
+#define ANU_SEQUENCE_H_
+
+#include "avrlib/base.h"
+
+namespace anu {
+
+// The size of the sequence is that of the unpacked sequences saved by the
+// previous versions of the firmware, so it still fits in the same EEPROM
+// slot and SysEx blocks.
+static const uint8_t kSequenceDataSize = 159;
+static const uint8_t kSequenceMaxLength = 255;
+static const uint8_t kSequenceReferenceNote = 60;
+
+static const uint8_t kSequenceRest = 0xff;
+static const uint8_t kSequenceTie = 0xfe;
+
+// Unpacked sequences of the previous versions of the firmware: the number of
+// notes, a byte per step (a note, kSequenceRest or kSequenceTie), then the
+// bitmaps of the accents and slides (bit i & 7 of byte i >> 3 for step i).
+static const uint8_t kLegacySequenceLength = 128;
+static const uint8_t kLegacySequenceFlagsSize = kLegacySequenceLength / 8;
+static const uint8_t kLegacySequenceSize = 1 + kLegacySequenceLength + \
+    2 * kLegacySequenceFlagsSize;
+
+enum SequenceFlag {
+  SEQUENCE_FLAG_SLIDE = 0x20,
+  SEQUENCE_FLAG_ACCENT = 0x40
+};
+
+struct Sequence {
+  uint8_t num_notes;
+  uint8_t size;
+  uint8_t data[kSequenceDataSize];
+  
+  // The unused part of the data is not saved. The size is checked since
+  // the sequence can be received by SysEx.
+  inline uint8_t packed_size() const {
+    return (size > kSequenceDataSize ? kSequenceDataSize : size) + 2;
+  }
+};
+
+// Reads a sequence saved with its packed size. Returns false if it is not
+// valid: if its checksum is wrong, or if its codes do not add up to its number
+// of steps.
+bool ReadSequence(Sequence* sequence, const uint8_t* address);
+
+// Reads and converts a sequence saved in the unpacked format. Returns false if
+// there is none at this address.
+bool ReadLegacySequence(Sequence* sequence, const uint8_t* address);
+
+// Sets the flags of the notes of a sequence converted from the unpacked
+// format, from its bitmaps of accents and slides.
+void SetLegacySequenceFlags(
+    Sequence* sequence,
+    const uint8_t* accents,
+    const uint8_t* slides);
+
+struct SequenceStep {
+  uint8_t note;
+  uint8_t flags;
+};
+
+class SequenceWriter {
+ public:
+  SequenceWriter() { }
+  
+  // Clears the sequence.
+  void Init(Sequence* sequence);
+  
+  // The flags apply to the next note. They are cleared by a rest or a tie.
+  inline void set_flags(uint8_t flags) {
+    flags_ |= flags;
+  }
+  
+  void AppendNote(uint8_t note);
+  inline void AppendRest() { AppendRun(0xc0); }
+  inline void AppendTie() { AppendRun(0xe0); }
+  
+  // Appends a note, kSequenceRest or kSequenceTie.
+  void AppendStep(uint8_t note);
+  
+  // True when there might not be room left for another step.
+  inline bool full() const {
+    return sequence_->num_notes == kSequenceMaxLength ||
+        sequence_->size > kSequenceDataSize - 2;
+  }
+  
+ private:
+  void AppendRun(uint8_t code);
+  
+  Sequence* sequence_;
+  uint8_t note_;
+  uint8_t flags_;
+  
+  DISALLOW_COPY_AND_ASSIGN(SequenceWriter);
+};
+
+class SequenceReader {
+ public:
+  SequenceReader() { }
+  
+  inline void Init(const Sequence* sequence) {
+    sequence_ = sequence;
+    Rewind();
+  }
+  
+  inline void Rewind() {
+    position_ = 0;
+    note_ = kSequenceReferenceNote;
+    run_length_ = 0;
+  }
+  
+  // Past the end of the data, rests are returned.
+  SequenceStep Next();
+  
+ private:
+  const Sequence* sequence_;
+  uint8_t position_;
+  uint8_t note_;
+  
+  // Remaining steps of the current run of rests or ties.
+  uint8_t run_length_;
+  uint8_t run_note_;
+  
+  DISALLOW_COPY_AND_ASSIGN(SequenceReader);
+};
+
+}  // namespace anu
+
+#endif  // ANU_SEQUENCE_H_
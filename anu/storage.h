@@ -21,6 +21,8 @@
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
 
+#include "anu/eeprom_writer.h"
+
 namespace anu {
 
 template<typename T>
@@ -33,8 +35,8 @@ struct StorageLayout {
 class Storage {
  public:
   template<typename T>
-  static void Save(const T& data) {
-    Save(&data, StorageLayout<T>::eeprom_address(), sizeof(T));
+  static bool Save(const T& data) {
+    return Save(&data, StorageLayout<T>::eeprom_address(), sizeof(T));
   };
   
   template<typename T>
@@ -58,21 +60,25 @@ class Storage {
     Save(*data);
   };
 
-  static void Save(const void* data, uint8_t* address, uint16_t size) {
-    uint8_t checksum = Checksum(data, size);
-    eeprom_write_block(data, address, size);
-    eeprom_write_byte(address + size, checksum);
+  // The data is written in the background, along with its checksum. It must
+  // stay in memory until then. Returns false if the EEPROM writer is full.
+  static bool Save(const void* data, uint8_t* address, uint16_t size) {
+    return eeprom_writer.Write(data, address, size);
   };
 
+  // Returns false if the checksum is not valid.
+  static bool Read(void* data, const uint8_t* address, uint16_t size) {
+    eeprom_read_block(data, address, size);
+    return eeprom_read_byte(address + size) == Checksum(data, size);
+  };
+  
   static void Load(
       void* data,
       uint8_t* address,
       uint16_t size,
       const prog_char* default_data,
       bool force_reinitialization) {
-    eeprom_read_block(data, address, size);
-    uint16_t checksum = eeprom_read_byte(address + size);
-    if (checksum != Checksum(data, size) || force_reinitialization) {
+    if (!Read(data, address, size) || force_reinitialization) {
       memcpy_P(data, default_data, size);
     }
   };
@@ -15,7 +15,9 @@
 
 #include "anu/sysex_handler.h"
 
-#include "anu/midi_dispatcher.h"
+#include <avr/interrupt.h>
+
+#include "anu/midi_out_queue.h"
 #include "anu/storage.h"
 #include "anu/system_settings.h"
 #include "anu/voice_controller.h"
@@ -43,6 +45,57 @@ uint8_t SysExHandler::rx_checksum_;
 /* static */
 uint8_t SysExHandler::rx_command_[2];
 
+/* static */
+bool SysExHandler::rx_packed_;
+
+/* static */
+uint8_t SysExHandler::rx_size_;
+
+/* static */
+uint8_t SysExHandler::rx_msbs_;
+
+/* static */
+SequenceWriter SysExHandler::rx_legacy_writer_;
+
+/* static */
+uint8_t SysExHandler::rx_legacy_num_notes_ = 0xff;
+
+/* static */
+const uint8_t* SysExHandler::tx_data_ = NULL;
+
+/* static */
+uint8_t SysExHandler::tx_size_;
+
+/* static */
+uint16_t SysExHandler::tx_position_;
+
+/* static */
+uint8_t SysExHandler::tx_checksum_;
+
+/* static */
+uint8_t SysExHandler::tx_command_[2];
+
+/* static */
+bool SysExHandler::tx_packed_;
+
+/* static */
+uint8_t SysExHandler::tx_group_[7];
+
+/* static */
+uint8_t SysExHandler::tx_object_ = SYSEX_OBJECT_TYPE_LAST;
+
+/* static */
+uint8_t SysExHandler::tx_dump_command_;
+
+/* static */
+bool SysExHandler::tx_counters_pending_ = false;
+
+/* static */
+uint8_t SysExHandler::tx_counters_command_;
+
+/* static */
+PerformanceCountersData SysExHandler::tx_counters_;
+
 static const prog_uint8_t header[] PROGMEM = {
   0xf0,  // <SysEx>
   0x00, 0x21, 0x02,  // Mutable Instruments manufacturer ID.
@@ -54,8 +107,32 @@ static const prog_uint8_t header[] PROGMEM = {
   // - 0x00: System Settings
   // - 0x01: Patch
   // - 0x02: SequencerSettings
-  // - 0x03: Sequence (first block of 128 bytes)
-  // - 0x04: Sequence (second block of remaining bytes)
+  // - 0x03: Unpacked sequence of the previous firmware versions (number of
+  //   notes and notes 0 to 126). Received only, and converted.
+  // - 0x04: Unpacked sequence (note 127, accents and slides bitmaps).
+  //   Received only, and converted.
+  // - 0x05: Sequence (first block of 128 bytes)
+  // - 0x06: Sequence (second block of remaining bytes)
+  // * Command byte:
+  // - 0x02: Performance counters (PerformanceCountersData)
+  // * Argument byte: 0x00
+  //
+  // Requests:
+  // - 0x11: Dump all data structures (argument ignored)
+  // - 0x12: Dump the performance counters. With the argument 0x01, the peak
+  //   load and the underrun counters are reset after the dump.
+  // - 0x13: Store the patch, the sequencer settings and the sequence in the
+  //   program slot given by the argument (0 to 15), to be recalled by a
+  //   Program Change. The request is ignored while the EEPROM is being
+  //   written, or when there is no room left for the program.
+  //
+  // Then the data, followed by a checksum byte (sum of the data bytes), and
+  // 0xf7. With the commands above, each byte is sent as two nibbles, MSB
+  // first. When the bit 5 of the command byte is set (0x21, 0x22, 0x31,
+  // 0x32), the data and the checksum are packed instead: each group of 7
+  // bytes is sent as a byte holding their MSBs (bit i for the i-th byte),
+  // followed by their 7 lower bits. The last group can be shorter. The
+  // replies to the requests 0x31 and 0x32 are packed.
 };
 
 static const prog_uint8_t block_sizes[] PROGMEM = {
@@ -63,6 +140,8 @@ static const prog_uint8_t block_sizes[] PROGMEM = {
   sizeof(Patch),
   sizeof(SequencerSettings),
   128,
+  kLegacySequenceSize - 128,
+  128,
   sizeof(Sequence) - 128
 };
 
@@ -85,6 +164,10 @@ void* SysExHandler::GetObjectAddress(SysExObjectType type) {
     case SYSEX_OBJECT_TYPE_SEQUENCE_BLOCK_2:
       return static_cast<uint8_t*>(
           static_cast<void*>(voice_controller.mutable_sequence())) + 128;
+    
+    default:
+      // The unpacked sequences are not stored as is.
+      return NULL;
   }
 }
 
@@ -96,17 +179,25 @@ uint8_t SysExHandler::GetObjectSize(SysExObjectType type) {
 /* static */
 void SysExHandler::ParseCommand() {
   rx_bytes_received_ = 0;
+  rx_size_ = 0;
   rx_state_ = RECEIVING_DATA;
   rx_destination_ = rx_buffer_;
-  switch (rx_command_[0]) {
+  rx_packed_ = rx_command_[0] & kSysExPacked;
+  switch (rx_command_[0] & ~kSysExPacked) {
     case 0x01:  // Data structure transfer
       {
         SysExObjectType type = static_cast<SysExObjectType>(rx_command_[1]);
-        rx_expected_size_ = GetObjectSize(type);
+        if (type >= SYSEX_OBJECT_TYPE_LAST) {
+          rx_state_ = RECEPTION_ERROR;
+        } else {
+          rx_expected_size_ = GetObjectSize(type);
+        }
       }
       break;
     
     case 0x11:  // Data structure dump request
+    case 0x12:  // Performance counters request
+    case 0x13:  // Program store request
       rx_expected_size_ = 0;
       break;
 
@@ -117,48 +208,181 @@ void SysExHandler::ParseCommand() {
 }
 
 /* static */
-void SysExHandler::BulkDump() {
-  for (uint8_t object = 0; object < SYSEX_OBJECT_TYPE_LAST; ++object) {
-    SysExObjectType type = static_cast<SysExObjectType>(object);
-    const uint8_t* data = static_cast<uint8_t*>(GetObjectAddress(type));
-    uint8_t size = GetObjectSize(type);
-    
-    // Header.
-    for (uint8_t i = 0; i < sizeof(header); ++i) {
-      midi_dispatcher.SendBlocking(pgm_read_byte(header + i));
+void SysExHandler::StartBlock(
+    uint8_t command,
+    uint8_t argument,
+    const uint8_t* data,
+    uint8_t size) {
+  tx_command_[0] = command;
+  tx_command_[1] = argument;
+  tx_packed_ = command & kSysExPacked;
+  tx_data_ = data;
+  tx_size_ = size;
+  tx_position_ = 0;
+  tx_checksum_ = 0;
+}
+
+/* static */
+bool SysExHandler::StartNextBlock() {
+  // Do not start a block within a system exclusive message forwarded from the
+  // MIDI in.
+  if (midi_out_queue.system_exclusive()) {
+    return false;
+  }
+  if (tx_counters_pending_) {
+    tx_counters_pending_ = false;
+    StartBlock(
+        tx_counters_command_,
+        0x00,
+        static_cast<uint8_t*>(static_cast<void*>(&tx_counters_)),
+        sizeof(tx_counters_));
+  } else if (tx_object_ < SYSEX_OBJECT_TYPE_LAST) {
+    SysExObjectType type = static_cast<SysExObjectType>(tx_object_);
+    StartBlock(
+        tx_dump_command_,
+        tx_object_,
+        static_cast<uint8_t*>(GetObjectAddress(type)),
+        GetObjectSize(type));
+    ++tx_object_;
+    // The sequence is only sent in the packed format.
+    if (tx_object_ == SYSEX_OBJECT_TYPE_LEGACY_SEQUENCE_BLOCK_1) {
+      tx_object_ = SYSEX_OBJECT_TYPE_SEQUENCE_BLOCK_1;
     }
-    
-    // Command and argument.
-    midi_dispatcher.SendBlocking(0x01);
-    midi_dispatcher.SendBlocking(object);
-    
-    // Outputs the data.
-    uint8_t checksum = 0;
-    for (uint8_t i = 0; i < size; ++i) {
-      checksum += data[i];
-      midi_dispatcher.SendBlocking(U8ShiftRight4(data[i]));
-      midi_dispatcher.SendBlocking(data[i] & 0x0f);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* static */
+uint8_t SysExHandler::NextByte() {
+  uint16_t position = tx_position_++;
+  // Header.
+  if (position < sizeof(header)) {
+    return pgm_read_byte(header + position);
+  }
+  position -= sizeof(header);
+  
+  // Command and argument.
+  if (position < 2) {
+    return tx_command_[position];
+  }
+  position -= 2;
+  
+  return tx_packed_ ? NextPackedByte(position) : NextNibble(position);
+}
+
+/* static */
+uint8_t SysExHandler::NextNibble(uint16_t position) {
+  if (position >= 2 * (tx_size_ + 1)) {
+    return EndBlock();
+  }
+  if (position & 1) {
+    return tx_group_[0] & 0x0f;
+  }
+  tx_group_[0] = PayloadByte(position >> 1);
+  return U8ShiftRight4(tx_group_[0]);
+}
+
+/* static */
+uint8_t SysExHandler::NextPackedByte(uint8_t position) {
+  uint8_t start = (position >> 3) * 7;
+  uint8_t index = position & 7;
+  if (start > tx_size_) {
+    return EndBlock();
+  }
+  uint8_t group_size = tx_size_ + 1 - start;
+  if (group_size > 7) {
+    group_size = 7;
+  }
+  if (index) {
+    return index <= group_size ? tx_group_[index - 1] : EndBlock();
+  }
+  uint8_t msbs = 0;
+  for (uint8_t i = 0; i < group_size; ++i) {
+    uint8_t byte = PayloadByte(start + i);
+    if (byte & 0x80) {
+      msbs |= 1 << i;
     }
-    // Outputs a checksum.
-    midi_dispatcher.SendBlocking(U8ShiftRight4(checksum));
-    midi_dispatcher.SendBlocking(checksum & 0x0f);
+    tx_group_[i] = byte & 0x7f;
+  }
+  return msbs;
+}
 
-    // End of SysEx block.
-    midi_dispatcher.SendBlocking(0xf7);
+/* static */
+uint8_t SysExHandler::PayloadByte(uint8_t index) {
+  if (index == tx_size_) {
+    return tx_checksum_;
   }
+  uint8_t byte = tx_data_[index];
+  tx_checksum_ += byte;
+  return byte;
+}
+
+/* static */
+uint8_t SysExHandler::EndBlock() {
+  tx_data_ = NULL;
+  return 0xf7;
+}
+
+/* static */
+void SysExHandler::Refresh() {
+  while (midi_out_queue.writable() > kMidiOutQueueReserve) {
+    if (!tx_data_ && !StartNextBlock()) {
+      break;
+    }
+    midi_out_queue.SendSystem(NextByte());
+  }
+}
+
+/* static */
+void SysExHandler::BulkDump(bool packed) {
+  // If a dump is in progress, it is not restarted.
+  if (tx_object_ == SYSEX_OBJECT_TYPE_LAST) {
+    tx_object_ = 0;
+    tx_dump_command_ = packed ? 0x01 | kSysExPacked : 0x01;
+  }
+}
+
+/* static */
+void SysExHandler::DumpPerformanceCounters(bool reset, bool packed) {
+  // The snapshot is still waiting to be sent, or is being sent.
+  if (tx_counters_pending_ ||
+      tx_data_ == static_cast<void*>(&tx_counters_)) {
+    return;
+  }
+  // Take a snapshot, since the counters are updated by the interrupts.
+  PerformanceCountersData* data = performance_counters.mutable_data();
+  cli();
+  tx_counters_ = *data;
+  if (reset) {
+    data->peak_cpu_load = 0;
+    data->audio_underruns = 0;
+    data->dac_underruns = 0;
+    data->midi_in_overruns = 0;
+    data->midi_out_drops = 0;
+  }
+  sei();
+  tx_counters_command_ = packed ? 0x02 | kSysExPacked : 0x02;
+  tx_counters_pending_ = true;
 }
 
 /* static */
 void SysExHandler::AcceptBuffer() {
-  switch (rx_command_[0]) {
+  switch (rx_command_[0] & ~kSysExPacked) {
     case 0x01:  // Transfer
       {
         SysExObjectType type = static_cast<SysExObjectType>(rx_command_[1]);
-        void* address = GetObjectAddress(type);
-        uint8_t size = GetObjectSize(type);
-        memcpy(address, rx_buffer_, size);
-        if (type == SYSEX_OBJECT_TYPE_SEQUENCE_BLOCK_2) {
+        bool sequence_received = type == SYSEX_OBJECT_TYPE_SEQUENCE_BLOCK_2;
+        if (type == SYSEX_OBJECT_TYPE_LEGACY_SEQUENCE_BLOCK_1 ||
+            type == SYSEX_OBJECT_TYPE_LEGACY_SEQUENCE_BLOCK_2) {
+          sequence_received = AcceptLegacySequenceBlock(type);
+        } else {
+          memcpy(GetObjectAddress(type), rx_buffer_, GetObjectSize(type));
+        }
+        if (sequence_received) {
           voice_controller.SaveSequence();
+          voice_controller.RewindSequence();
         } else if (type == SYSEX_OBJECT_TYPE_SYSTEM_SETTINGS) {
           system_settings.Save();
         }
@@ -166,11 +390,53 @@ void SysExHandler::AcceptBuffer() {
       };
       break;
     case 0x11:  // Request
-      BulkDump();
+      BulkDump(rx_packed_);
+      break;
+    case 0x12:  // Performance counters request
+      DumpPerformanceCounters(rx_command_[1] == 0x01, rx_packed_);
+      break;
+    case 0x13:  // Program store request
+      voice_controller.StoreProgram(rx_command_[1]);
       break;
   }
 }
 
+/* static */
+bool SysExHandler::AcceptLegacySequenceBlock(SysExObjectType type) {
+  Sequence* sequence = voice_controller.mutable_sequence();
+  if (type == SYSEX_OBJECT_TYPE_LEGACY_SEQUENCE_BLOCK_1) {
+    uint8_t num_notes = rx_buffer_[0];
+    if (num_notes > kLegacySequenceLength) {
+      num_notes = kLegacySequenceLength;
+    }
+    rx_legacy_num_notes_ = num_notes;
+    rx_legacy_writer_.Init(sequence);
+    for (uint8_t i = 0; i < num_notes && i < kLegacySequenceLength - 1; ++i) {
+      if (rx_legacy_writer_.full()) {
+        break;
+      }
+      rx_legacy_writer_.AppendStep(rx_buffer_[1 + i]);
+    }
+    return false;
+  }
+  
+  // The flags are only known once the second block is received.
+  if (rx_legacy_num_notes_ == 0xff) {
+    return false;
+  }
+  if (rx_legacy_num_notes_ == kLegacySequenceLength &&
+      sequence->num_notes == kLegacySequenceLength - 1 &&
+      !rx_legacy_writer_.full()) {
+    rx_legacy_writer_.AppendStep(rx_buffer_[0]);
+  }
+  SetLegacySequenceFlags(
+      sequence,
+      rx_buffer_ + 1,
+      rx_buffer_ + 1 + kLegacySequenceFlagsSize);
+  rx_legacy_num_notes_ = 0xff;
+  return true;
+}
+
 /* static */
 void SysExHandler::Receive(uint8_t rx_byte) {
   if (rx_byte == 0xf0) {
@@ -200,7 +466,22 @@ void SysExHandler::Receive(uint8_t rx_byte) {
       break;
 
     case RECEIVING_DATA:
-      {
+      if (rx_packed_) {
+        if (!(rx_bytes_received_ & 7)) {
+          rx_msbs_ = rx_byte;
+        } else {
+          uint8_t i = rx_size_++;
+          uint8_t byte = rx_byte | (rx_msbs_ & 1 ? 0x80 : 0);
+          rx_msbs_ >>= 1;
+          rx_destination_[i] = byte;
+          if (i < rx_expected_size_) {
+            rx_checksum_ += byte;
+          } else {
+            rx_state_ = RECEIVING_FOOTER;
+          }
+        }
+        rx_bytes_received_++;
+      } else {
         uint16_t i = rx_bytes_received_ >> 1;
         if (rx_bytes_received_ & 1) {
           rx_destination_[i] |= rx_byte & 0xf;
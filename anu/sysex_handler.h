@@ -18,6 +18,9 @@
 
 #include "avrlib/base.h"
 
+#include "anu/performance_counters.h"
+#include "anu/sequence.h"
+
 namespace anu {
   
 enum SysExReceptionState {
@@ -33,19 +36,42 @@ enum SysExObjectType {
   SYSEX_OBJECT_TYPE_SYSTEM_SETTINGS,
   SYSEX_OBJECT_TYPE_PATCH,
   SYSEX_OBJECT_TYPE_SEQUENCER_SETTINGS,
+  SYSEX_OBJECT_TYPE_LEGACY_SEQUENCE_BLOCK_1,
+  SYSEX_OBJECT_TYPE_LEGACY_SEQUENCE_BLOCK_2,
   SYSEX_OBJECT_TYPE_SEQUENCE_BLOCK_1,
   SYSEX_OBJECT_TYPE_SEQUENCE_BLOCK_2,
   SYSEX_OBJECT_TYPE_LAST
 };
 
+// Bit of the command byte selecting the packed encoding of the data.
+static const uint8_t kSysExPacked = 0x20;
+
 class SysExHandler {
  public:
-  static void BulkDump();
+  static void BulkDump(bool packed);
   static void Receive(uint8_t sysex_rx_byte);
   
+  // Called by the main loop. The requested blocks are streamed to the MIDI
+  // out only as fast as the output queue empties, leaving the entries it
+  // reserves for the note offs free.
+  static void Refresh();
+  
  private:
   static void ParseCommand();
   static void AcceptBuffer();
+  static bool AcceptLegacySequenceBlock(SysExObjectType type);
+  static bool StartNextBlock();
+  static void StartBlock(
+      uint8_t command,
+      uint8_t argument,
+      const uint8_t* data,
+      uint8_t size);
+  static uint8_t NextByte();
+  static uint8_t NextNibble(uint16_t position);
+  static uint8_t NextPackedByte(uint8_t position);
+  static uint8_t PayloadByte(uint8_t index);
+  static uint8_t EndBlock();
+  static void DumpPerformanceCounters(bool reset, bool packed);
 
   static void* GetObjectAddress(SysExObjectType type);
   static uint8_t GetObjectSize(SysExObjectType type);
@@ -57,6 +83,35 @@ class SysExHandler {
   static SysExReceptionState rx_state_;
   static uint8_t rx_checksum_;
   static uint8_t rx_command_[2];
+  static bool rx_packed_;
+  static uint8_t rx_size_;
+  static uint8_t rx_msbs_;
+  
+  // A sequence received in the unpacked format is converted as its blocks
+  // arrive. Number of steps announced by the first block, 0xff if none was
+  // received.
+  static SequenceWriter rx_legacy_writer_;
+  static uint8_t rx_legacy_num_notes_;
+  
+  // Block being sent, NULL if none.
+  static const uint8_t* tx_data_;
+  static uint8_t tx_size_;
+  static uint16_t tx_position_;
+  static uint8_t tx_checksum_;
+  static uint8_t tx_command_[2];
+  static bool tx_packed_;
+  // Bytes of the payload being sent. The payload is read ahead of the
+  // output, so that the data and its checksum stay consistent if the object
+  // is edited during the transfer.
+  static uint8_t tx_group_[7];
+  
+  // Next object of the bulk dump, SYSEX_OBJECT_TYPE_LAST if no bulk dump is
+  // in progress.
+  static uint8_t tx_object_;
+  static uint8_t tx_dump_command_;
+  static bool tx_counters_pending_;
+  static uint8_t tx_counters_command_;
+  static PerformanceCountersData tx_counters_;
   
   DISALLOW_COPY_AND_ASSIGN(SysExHandler);
 };
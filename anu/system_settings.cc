@@ -18,12 +18,13 @@
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
 
+#include "anu/eeprom_writer.h"
 #include "anu/resources.h"
 
 namespace anu {
 
 /* static */
-SystemSettingsData SystemSettings::data_;
+SystemSettingsRecord SystemSettings::record_;
 
 uint8_t midi_channel;
 uint8_t midi_out_mode;
@@ -62,6 +63,64 @@ const prog_SystemSettingsData init_settings PROGMEM = {
   0, 0, 0
 };
 
+/* static */
+void SystemSettings::Init() {
+  // Find the most recent record.
+  uint8_t newest = kNumSystemSettingsRecords;
+  uint8_t newest_sequence = 0;
+  for (uint8_t i = 0; i < kNumSystemSettingsRecords; ++i) {
+    uint8_t sequence = eeprom_read_byte(record_address(i));
+    if ((sequence & (kNumSystemSettingsRecords - 1)) != i) {
+      continue;
+    }
+    if (newest == kNumSystemSettingsRecords ||
+        static_cast<int8_t>(sequence - newest_sequence) > 0) {
+      newest = i;
+      newest_sequence = sequence;
+    }
+  }
+  
+  // Load it, or the previous one if its checksum is not valid.
+  if (newest != kNumSystemSettingsRecords) {
+    for (uint8_t i = 0; i < 2; ++i) {
+      uint8_t sequence = newest_sequence - i;
+      if (storage.Read(&record_, record_address(sequence), sizeof(record_)) &&
+          record_.sequence == sequence) {
+        return;
+      }
+    }
+  } else {
+    newest_sequence = 0xff;
+  }
+  
+  // No valid record: load the settings from their previous location, or the
+  // factory defaults. The next save goes past the most recent record.
+  storage.Load(&record_.data);
+  record_.sequence = newest_sequence;
+}
+
+/* static */
+void SystemSettings::ResetToFactoryDefaults() {
+  memcpy_P(&record_.data, &init_settings, sizeof(SystemSettingsData));
+  Save();
+}
+
+/* static */
+void SystemSettings::Save() {
+  // While the previous record is waiting to be written, it will carry the
+  // latest settings. Otherwise, they are written in the next record.
+  uint8_t* address = record_address(record_.sequence);
+  if (!eeprom_writer.queued(address)) {
+    ++record_.sequence;
+    address = record_address(record_.sequence);
+    if (!storage.Save(&record_, address, sizeof(record_))) {
+      // The EEPROM writer is full: the settings will be written by the next
+      // save.
+      --record_.sequence;
+    }
+  }
+}
+
 /* extern */
 SystemSettings system_settings;
 
@@ -41,11 +41,13 @@ struct SystemSettingsData {
   uint16_t vco_cv_scale_low;
   uint16_t vco_cv_scale_high;
   uint8_t more_padding[3];
-};
+} __attribute__((packed));
 
 typedef SystemSettingsData PROGMEM prog_SystemSettingsData;
 extern const prog_SystemSettingsData init_settings PROGMEM;
 
+// Location of the settings saved by the previous versions of the firmware.
+// They are loaded when the journal below is empty.
 template<>
 struct StorageLayout<SystemSettingsData> {
   static uint8_t* eeprom_address() { 
@@ -56,74 +58,95 @@ struct StorageLayout<SystemSettingsData> {
   }
 };
 
+// The settings are saved in a journal of records, each of them made of a
+// sequence number, the settings, and the checksum appended by the storage.
+// Each save goes to the next record, so the writes are spread over the whole
+// journal. The record i only holds the sequence numbers equal to i modulo the
+// number of records: at boot time, the sequence numbers of the records are
+// scanned to find the most recent one, and if its write has been interrupted,
+// the previous one is loaded instead. The scan reads at most
+// kNumSystemSettingsRecords + 2 * kSystemSettingsRecordSize bytes.
+struct SystemSettingsRecord {
+  uint8_t sequence;
+  SystemSettingsData data;
+} __attribute__((packed));
+
+static const uint8_t kNumSystemSettingsRecords = 8;
+static const uint8_t kSystemSettingsRecordSize = \
+    sizeof(SystemSettingsRecord) + 1;
+static const uint16_t kSystemSettingsJournalAddress = 29;
+
 class SystemSettings {
  public:
   SystemSettings() { }
   
-  static void Init() {
-    storage.Load(&data_);
-  }
-  
-  static void ResetToFactoryDefaults() {
-    storage.ResetToFactoryDefaults(&data_);
-  }
+  static void Init();
+  static void ResetToFactoryDefaults();
   
   static inline uint8_t receive_channel(uint8_t channel) {
-    return channel == data_.midi_channel;
+    return channel == record_.data.midi_channel;
   }
   
   static inline uint8_t midi_channel() {
-    return data_.midi_channel;
+    return record_.data.midi_channel;
   }
   
-  static inline uint8_t midi_out_mode() { return data_.midi_out_mode; }
-  static inline uint8_t clock_ppqn() { return data_.clock_ppqn; }
-  static inline uint8_t reference_note() { return data_.reference_note; }
-  static inline int16_t vco_cv_offset() { return data_.vco_cv_offset; }
-  static inline uint16_t vco_cv_scale_low() { return data_.vco_cv_scale_low; }
-  static inline uint16_t vco_cv_scale_high() { return data_.vco_cv_scale_high; }
+  static inline uint8_t midi_out_mode() { return record_.data.midi_out_mode; }
+  static inline uint8_t clock_ppqn() { return record_.data.clock_ppqn; }
+  static inline uint8_t reference_note() { return record_.data.reference_note; }
+  static inline int16_t vco_cv_offset() { return record_.data.vco_cv_offset; }
+  static inline uint16_t vco_cv_scale_low() {
+    return record_.data.vco_cv_scale_low;
+  }
+  static inline uint16_t vco_cv_scale_high() {
+    return record_.data.vco_cv_scale_high;
+  }
 
   static void ChangePpqn() {
-    ++data_.clock_ppqn;
-    if (data_.clock_ppqn > 2) {
-      data_.clock_ppqn = 0;
+    ++record_.data.clock_ppqn;
+    if (record_.data.clock_ppqn > 2) {
+      record_.data.clock_ppqn = 0;
     }
-    storage.Save(data_);
+    Save();
   }
   
   static void set_calibration_data(uint16_t a, uint16_t b, uint16_t c) {
-    data_.vco_cv_offset = a;
-    data_.vco_cv_scale_low = b;
-    data_.vco_cv_scale_high = c;
-    storage.Save(data_);
+    record_.data.vco_cv_offset = a;
+    record_.data.vco_cv_scale_low = b;
+    record_.data.vco_cv_scale_high = c;
+    Save();
   }
   
   static void set_midi_channel(uint8_t channel, uint8_t note) {
-    data_.reference_note = note;
-    data_.midi_channel = channel;
-    storage.Save(data_);
+    record_.data.reference_note = note;
+    record_.data.midi_channel = channel;
+    Save();
   }
   
   static void set_midi_out_mode(uint8_t mode) {
-    data_.midi_out_mode = mode;
-    storage.Save(data_);
+    record_.data.midi_out_mode = mode;
+    Save();
   }
   
   static void set_midi_channel(uint8_t channel) {
-    data_.midi_channel = channel;
-    storage.Save(data_);
+    record_.data.midi_channel = channel;
+    Save();
   }
   
   static SystemSettingsData* mutable_data() {
-    return &data_;
+    return &record_.data;
   }
   
-  static void Save() {
-    storage.Save(data_);
-  }
+  static void Save();
 
  private:
-  static SystemSettingsData data_;
+  static uint8_t* record_address(uint8_t sequence) {
+    uint8_t index = sequence & (kNumSystemSettingsRecords - 1);
+    return (uint8_t*)(kSystemSettingsJournalAddress) + \
+        index * kSystemSettingsRecordSize;
+  }
+  
+  static SystemSettingsRecord record_;
 };
 
 extern SystemSettings system_settings;
@@ -17,6 +17,7 @@
 
 #include "avrlib/adc.h"
 
+#include "anu/eeprom_writer.h"
 #include "anu/hardware_config.h"
 #include "anu/midi_dispatcher.h"
 #include "anu/parameter.h"
@@ -44,7 +45,6 @@ uint16_t Ui::adc_values_[kNumPots];
 uint8_t Ui::adc_thresholds_[kNumPots];
 uint8_t Ui::scanned_pot_;
 uint8_t Ui::pot_scanning_warm_up_ = 16;
-bool Ui::busy_ = false;
 bool Ui::snapped_[kNumPots];
 int16_t Ui::snap_position_cache_[kNumPots];
 int8_t Ui::display_snap_delta_ = 0;
@@ -224,9 +224,7 @@ void Ui::HandleSwitchEvent(uint8_t index) {
       
     case CONTROL_REC_BUTTON:
       if (voice_controller.sequencer_recording()) {
-        busy_ = true;
         voice_controller.StopRecording();
-        busy_ = false;
         strummer_enabled_ = false;
       } else {
         voice_controller.StartRecording();
@@ -272,7 +270,7 @@ void Ui::HandleSwitchEvent(uint8_t index) {
       break;
       
     case CONTROL_RUN_STOP_LONG_PRESS:
-      sysex_handler.BulkDump();
+      sysex_handler.BulkDump(false);
       break;
   }
 }
@@ -392,11 +390,9 @@ void Ui::DoEvents() {
 
 /* static */
 void Ui::TrySavingSettings() {
-  if (voice_controller.at_rest() && drum_synth.idle_time_ms() > 10000) {
-    busy_ = true;
-    voice_controller.SavePatch();
-    busy_ = false;
-  }
+  // The EEPROM is written in the background, so there is no need to wait for
+  // the instrument to be at rest.
+  voice_controller.SavePatch();
 }
 
 /* static */
@@ -441,7 +437,7 @@ void Ui::UpdateLeds() {
   // 3 vertical LEDs.
   
   // Default status: current page.
-  if (voice_controller.sequencer_recording() || busy_) {
+  if (voice_controller.sequencer_recording() || eeprom_writer.busy()) {
     led_pattern |= \
         _BV(OUTPUT_ROW_1_LED) | _BV(OUTPUT_ROW_2_LED) | _BV(OUTPUT_ROW_3_LED);
   } else {
@@ -107,7 +107,6 @@ class Ui {
   static uint8_t display_mode_;
   static uint8_t scanned_pot_;
   static uint8_t pot_scanning_warm_up_;
-  static bool busy_;
   static int8_t display_snap_delta_;
   static avrlib::EventQueue<16> queue_;
   static uint8_t disable_switch_sensing_;
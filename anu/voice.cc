@@ -74,9 +74,16 @@ void Voice::Init() {
   dirty_ = false;
   retriggered_ = false;
   volume_ = 240;
+  dac_state_changes_ = DAC_CHANNEL_ALL;
+  dac_timestamp_ = 0;
+  dac_write_timestamp_ = 0;
+  note_on_scheduled_ = false;
+  control_cycle_ = 0;
+  pw_cv_.Init();
+  vcf_cv_.Init();
 
   ResetAllControllers();
-  UpdateEnvelopeParameters();
+  Touch();
 }
 
 void Voice::ControlChange(uint8_t controller, uint8_t value) {
@@ -87,10 +94,12 @@ void Voice::ControlChange(uint8_t controller, uint8_t value) {
       
     case midi::kModulationWheelMsb:
       mod_wheel_ = value;
+      stale_derived_parameters_ |= DERIVED_MOD_WHEEL;
       break;
       
     case midi::kBreathController:
       mod_wheel_2_ = value;
+      stale_derived_parameters_ |= DERIVED_CONTROL_RATES;
       break;
     
   }
@@ -103,6 +112,17 @@ void Voice::SetValue(uint8_t offset, uint8_t value) {
   bytes[offset] = value;
   if (offset >= PRM_PATCH_ENV_ATTACK && offset < PRM_PATCH_ENV_PADDING_1) {
     UpdateEnvelopeParameters();
+  } else if (offset <= PRM_PATCH_VCO_FINE) {
+    stale_derived_parameters_ |= DERIVED_PITCH_OFFSETS;
+  } else if (offset == PRM_PATCH_LFO_SHAPE || offset == PRM_PATCH_LFO_RATE) {
+    stale_derived_parameters_ |= DERIVED_LFO;
+  } else if (offset == PRM_PATCH_VIBRATO_RATE) {
+    stale_derived_parameters_ |= DERIVED_VIBRATO_LFO | DERIVED_CONTROL_RATES;
+  } else if (offset == PRM_PATCH_VIBRATO_DESTINATION) {
+    stale_derived_parameters_ |= DERIVED_MOD_WHEEL;
+  } else if (offset == PRM_PATCH_PW_LFO_AMOUNT ||
+             offset == PRM_PATCH_CUTOFF_LFO_AMOUNT) {
+    stale_derived_parameters_ |= DERIVED_CONTROL_RATES;
   }
   if (previous_value != value) {
     dirty_ = true;
@@ -140,6 +160,67 @@ void Voice::UpdateEnvelopeParameters() {
   vca_envelope_.Update(vca_a, vca_d, vca_s, vca_r);
 }
 
+void Voice::UpdateDerivedParameters() {
+  uint8_t stale = stale_derived_parameters_;
+  stale_derived_parameters_ = 0;
+  
+  if (stale & DERIVED_LFO) {
+    lfo_.set_shape(static_cast<LfoShape>(patch_.lfo_shape));
+    // Below 2, the LFO rate is locked to the MIDI clock, and the phase
+    // increment is adjusted by set_lfo_pll_target_phase.
+    if (patch_.lfo_rate >= 2) {
+      lfo_.set_phase_increment(
+          pgm_read_dword(lut_res_lfo_increments + patch_.lfo_rate));
+    }
+  }
+  
+  if (stale & DERIVED_VIBRATO_LFO) {
+    vibrato_lfo_.set_phase_increment(pgm_read_dword(
+        lut_res_lfo_increments + 96 + (patch_.vibrato_rate >> 1)));
+  }
+  
+  if (stale & DERIVED_MOD_WHEEL) {
+    // The mod wheel is split between vibrato and growl.
+    uint8_t vibrato_destination = patch_.vibrato_destination;
+    if (vibrato_destination < 128) {
+      mod_wheel_pitch_ = mod_wheel_;
+      mod_wheel_growl_ = U8U8MulShift8(vibrato_destination << 1, mod_wheel_);
+    } else {
+      vibrato_destination = ~vibrato_destination;
+      mod_wheel_growl_ = mod_wheel_;
+      mod_wheel_pitch_ = U8U8MulShift8(vibrato_destination << 1, mod_wheel_);
+    }
+  }
+  
+  if (stale & DERIVED_PITCH_OFFSETS) {
+    dco_pitch_offset_ = S8U8Mul(patch_.vco_dco_range, 6) << 8;
+    dco_pitch_offset_ += patch_.vco_dco_fine;
+    vco_pitch_offset_ = S8U8Mul(patch_.vco_detune, 128);
+    vco_pitch_offset_ += patch_.vco_fine;
+  }
+  
+  if (stale & (DERIVED_LFO | DERIVED_VIBRATO_LFO | DERIVED_MOD_WHEEL | \
+               DERIVED_CONTROL_RATES)) {
+    // The PW and VCF CVs are computed at a quarter of the DAC rate, or at
+    // half of it when they are modulated by a fast LFO. The envelopes
+    // override this when they are moving.
+    // The noise LFO shape is never decimated.
+    uint8_t lfo_rate_shift = 2;
+    if (patch_.lfo_shape == LFO_SHAPE_NOISE) {
+      lfo_rate_shift = 0;
+    } else if (patch_.lfo_rate >= kFastLfoRate) {
+      lfo_rate_shift = 1;
+    }
+    bool fast_vibrato_lfo = 96 + (patch_.vibrato_rate >> 1) >= kFastLfoRate;
+    pw_rate_shift_ = patch_.pw_lfo_amount ? lfo_rate_shift : 2;
+    vcf_rate_shift_ = patch_.cutoff_lfo_amount ? lfo_rate_shift : 2;
+    if ((mod_wheel_growl_ || mod_wheel_2_) && fast_vibrato_lfo &&
+        vcf_rate_shift_ > 1) {
+      vcf_rate_shift_ = 1;
+    }
+  }
+}
+
 void Voice::PitchBend(uint16_t pitch_bend) {
   mod_pitch_bend_ = pitch_bend;
 }
@@ -149,6 +230,7 @@ void Voice::Aftertouch(uint8_t velocity) {
 }
 
 void Voice::AllSoundOff() {
+  note_on_scheduled_ = false;
   vca_envelope_.Trigger(ENV_SEGMENT_DEAD);
   vcf_envelope_.Trigger(ENV_SEGMENT_DEAD);
   mod_envelope_.Trigger(ENV_SEGMENT_DEAD);
@@ -157,6 +239,7 @@ void Voice::AllSoundOff() {
 void Voice::ResetAllControllers() {
   mod_pitch_bend_ = 8192;
   mod_wheel_ = 0;
+  stale_derived_parameters_ |= DERIVED_MOD_WHEEL;
   mod_wheel_2_ = 0;
   mod_aftertoutch_ = 0;
 }
@@ -169,27 +252,16 @@ void Voice::Refresh() {
 
 void Voice::WriteDACStateSample() {
   uint8_t w = dac_state_write_ptr_;
-      
-  lfo_.set_shape(static_cast<LfoShape>(patch_.lfo_shape));
-  if (patch_.lfo_rate >= 2) {
-    lfo_.set_phase_increment(
-        pgm_read_dword(lut_res_lfo_increments + patch_.lfo_rate));
-  }
-  vibrato_lfo_.set_phase_increment(
-      pgm_read_dword(lut_res_lfo_increments + 96 + (patch_.vibrato_rate >> 1)));
-
-  uint8_t mod_wheel_pitch = 0;
-  uint8_t mod_wheel_growl = 0;
-  uint8_t vibrato_destination = patch_.vibrato_destination;
-  if (vibrato_destination < 128) {
-    mod_wheel_pitch = mod_wheel_;
-    mod_wheel_growl = U8U8MulShift8(vibrato_destination << 1, mod_wheel_);
-  } else {
-    vibrato_destination = ~vibrato_destination;
-    mod_wheel_growl = mod_wheel_;
-    mod_wheel_pitch = U8U8MulShift8(vibrato_destination << 1, mod_wheel_);
+  
+  if (note_on_scheduled_ && static_cast<int8_t>(
+          dac_write_timestamp_ - scheduled_note_on_.timestamp) >= 0) {
+    FlushScheduledNoteOn();
   }
+  ++dac_write_timestamp_;
   
+  if (stale_derived_parameters_) {
+    UpdateDerivedParameters();
+  }
 
   // Compute modulation sources.
   uint16_t lfo_unsigned = lfo_.Render();
@@ -207,13 +279,11 @@ void Voice::WriteDACStateSample() {
   int16_t pitch = Mix(pitch_source_, pitch_target_, pitch_counter_);
   pitch_ = pitch;
   pitch += (mod_pitch_bend_ - 8192) >> 5;
-  pitch += S8U8Mul(patch_.vco_dco_range, 6) << 8;
-  pitch += patch_.vco_dco_fine;
-  pitch += S8U8MulShift8(vibrato_lfo >> 8, mod_wheel_pitch);
+  pitch += dco_pitch_offset_;
+  pitch += S8U8MulShift8(vibrato_lfo >> 8, mod_wheel_pitch_);
   dco_pitch_ = pitch;
   
-  pitch += S8U8Mul(patch_.vco_detune, 128);
-  pitch += patch_.vco_fine;
+  pitch += vco_pitch_offset_;
   pitch += U16U8MulShift8(mod_envelope, patch_.vco_env_amount) >> 4;
   pitch += S16U8MulShift8(lfo, patch_.vco_lfo_amount) >> 4;
 
@@ -229,39 +299,54 @@ void Voice::WriteDACStateSample() {
   dac_state_buffer_[w].vco_cv = pitch;
   
   // PW CV.
-  int16_t pw = 0;
-  pw += U16U8MulShift8(mod_envelope, patch_.pw_env_amount) >> 2;
-  pw += U16U8MulShift8(lfo + 32768, patch_.pw_lfo_amount) >> 2;
-  pw >>= 2;
-  CLIP_12(pw);
-  dac_state_buffer_[w].pw_cv = pw;
-  
-  // VCF CV.
-  uint16_t vcf_envelope = vcf_envelope_.Render();
-  int16_t cutoff = 60 * 128;
-  cutoff += S16U8MulShift8(dco_pitch_ - 60 * 128, patch_.cutoff_tracking) << 1;
-  cutoff += S8U8Mul(patch_.cutoff_bias + 128, 64);
-  uint16_t growl_amount = mod_wheel_growl;
-  growl_amount += mod_wheel_2_;
-  // if (mod_aftertoutch_ > 112) {
-  //   growl_amount += (mod_aftertoutch_ - 112) << 2;
-  // }
-  if (growl_amount >= 255) {
-    growl_amount = 255;
+  uint8_t rate_shift = 0;
+  if (mod_envelope_.steady() || !patch_.pw_env_amount) {
+    rate_shift = pw_rate_shift_;
   }
-  cutoff += S16U8MulShift8(vibrato_lfo, growl_amount) >> 3;
-  uint16_t env_amount = patch_.cutoff_env_amount + (mod_accent_ >> 1);
-  env_amount += U8U8MulShift8(mod_velocity_, patch_.kbd_velocity_vcf_amount);
-  if (env_amount > 255) {
-    env_amount = 255;
+  if (!(control_cycle_ & ((1 << rate_shift) - 1))) {
+    int16_t pw = 0;
+    pw += U16U8MulShift8(mod_envelope, patch_.pw_env_amount) >> 2;
+    pw += U16U8MulShift8(lfo + 32768, patch_.pw_lfo_amount) >> 2;
+    pw >>= 2;
+    CLIP_12(pw);
+    pw_cv_.Start(pw, rate_shift);
+  }
+  dac_state_buffer_[w].pw_cv = pw_cv_.Next();
+  
+  // VCF CV. The envelope is not rendered when it is steady, since its value
+  // does not change.
+  rate_shift = vcf_envelope_.steady() ? vcf_rate_shift_ : 0;
+  if (!(control_cycle_ & ((1 << rate_shift) - 1))) {
+    uint16_t vcf_envelope = vcf_envelope_.Render();
+    int16_t cutoff = 60 * 128;
+    cutoff += S16U8MulShift8(
+        dco_pitch_ - 60 * 128,
+        patch_.cutoff_tracking) << 1;
+    cutoff += S8U8Mul(patch_.cutoff_bias + 128, 64);
+    uint16_t growl_amount = mod_wheel_growl_;
+    growl_amount += mod_wheel_2_;
+    // if (mod_aftertoutch_ > 112) {
+    //   growl_amount += (mod_aftertoutch_ - 112) << 2;
+    // }
+    if (growl_amount >= 255) {
+      growl_amount = 255;
+    }
+    cutoff += S16U8MulShift8(vibrato_lfo, growl_amount) >> 3;
+    uint16_t env_amount = patch_.cutoff_env_amount + (mod_accent_ >> 1);
+    env_amount += U8U8MulShift8(mod_velocity_, patch_.kbd_velocity_vcf_amount);
+    if (env_amount > 255) {
+      env_amount = 255;
+    }
+    cutoff += U16U8MulShift8(vcf_envelope, env_amount) >> 2;
+    cutoff += S16U8MulShift8(lfo, patch_.cutoff_lfo_amount) >> 3;
+    // cutoff += U8U8Mul(mod_aftertoutch_, 64);
+    cutoff = static_cast<int32_t>(cutoff - kVcfCvOffset) * kVcfCvScale >> 16;
+    cutoff += 2048;
+    CLIP_12(cutoff);
+    vcf_cv_.Start(cutoff, rate_shift);
   }
-  cutoff += U16U8MulShift8(vcf_envelope, env_amount) >> 2;
-  cutoff += S16U8MulShift8(lfo, patch_.cutoff_lfo_amount) >> 3;
-  // cutoff += U8U8Mul(mod_aftertoutch_, 64);
-  cutoff = static_cast<int32_t>(cutoff - kVcfCvOffset) * kVcfCvScale >> 16;
-  cutoff += 2048;
-  CLIP_12(cutoff);
-  dac_state_buffer_[w].vcf_cv = cutoff;
+  dac_state_buffer_[w].vcf_cv = vcf_cv_.Next();
+  ++control_cycle_;
   
   // VCA CV.
   uint16_t vca_envelope = U16U8MulShift8(
@@ -273,6 +358,7 @@ void Voice::WriteDACStateSample() {
 }
 
 void Voice::GateOn() {
+  FlushScheduledNoteOn();
   vca_envelope_.Trigger(ENV_SEGMENT_ATTACK);
   vcf_envelope_.Trigger(ENV_SEGMENT_ATTACK);
   mod_envelope_.Trigger(ENV_SEGMENT_ATTACK);
@@ -282,6 +368,7 @@ void Voice::GateOn() {
 }
 
 void Voice::GateOff() {
+  FlushScheduledNoteOn();
   vca_envelope_.Trigger(ENV_SEGMENT_RELEASE);
   vcf_envelope_.Trigger(ENV_SEGMENT_RELEASE);
   mod_envelope_.Trigger(ENV_SEGMENT_RELEASE);
@@ -293,6 +380,7 @@ void Voice::NoteOn(
     uint8_t slide,
     uint8_t accent,
     bool legato) {
+  FlushScheduledNoteOn();
   if (!legato || !patch_.env_legato_mode) {
     GateOn();
   }
@@ -318,21 +406,62 @@ void Voice::NoteOn(
   pitch_counter_ = 0;
 }
 
+void Voice::ScheduleNoteOn(
+    uint8_t note,
+    uint8_t velocity,
+    uint8_t slide,
+    uint8_t accent,
+    bool legato,
+    uint8_t timestamp) {
+  // The DAC state samples are computed at most kDACStateBufferSize samples
+  // ahead of the one being played, so the note on is never late.
+  FlushScheduledNoteOn();
+  scheduled_note_on_.note = note;
+  scheduled_note_on_.velocity = velocity;
+  scheduled_note_on_.slide = slide;
+  scheduled_note_on_.accent = accent;
+  scheduled_note_on_.legato = legato;
+  scheduled_note_on_.timestamp = timestamp + kDACStateBufferSize - 1;
+  note_on_scheduled_ = true;
+}
+
+void Voice::FlushScheduledNoteOn() {
+  // Any other event plays the scheduled note on first, so that the events
+  // keep their order.
+  if (note_on_scheduled_) {
+    note_on_scheduled_ = false;
+    NoteOn(
+        scheduled_note_on_.note,
+        scheduled_note_on_.velocity,
+        scheduled_note_on_.slide,
+        scheduled_note_on_.accent,
+        scheduled_note_on_.legato);
+  }
+}
+
 void Voice::NoteOff(uint8_t note) {
+  FlushScheduledNoteOn();
   if (note != 0xff) {
     GateOff();
   }
 }
 
 void Voice::SavePatch() {
-  if (dirty_) {
-    storage.Save(patch_);
+  // The patch stays dirty, and is saved at the next attempt, if the EEPROM
+  // writer is full.
+  if (dirty_ && storage.Save(patch_)) {
+    dirty_ = false;
   }
+}
+
+void Voice::LoadPatch() {
+  storage.Load(&patch_);
   dirty_ = false;
 }
 
 void Voice::ResetToFactoryDefaults() {
   storage.ResetToFactoryDefaults(&patch_);
+  stale_derived_parameters_ = DERIVED_ALL;
 }
 
 };  // namespace anu
@@ -19,6 +19,7 @@
 #include "avrlib/base.h"
 #include "avrlib/op.h"
 
+#include "anu/buffer_policy.h"
 #include "anu/lfo.h"
 #include "anu/envelope.h"
 #include "anu/note_stack.h"
@@ -63,7 +64,23 @@ enum PatchParameter {
   PRM_PATCH_LAST
 };
 
-static const uint8_t kDACStateBufferSize = 4;
+static const uint8_t kDACStateBufferSize = \
+    ActiveBufferPolicy::dac_state_buffer_size;
+
+// Values derived from the patch and controllers which are recomputed only
+// when their inputs change, rather than for every DAC state sample.
+enum DerivedParameter {
+  DERIVED_LFO = 1,
+  DERIVED_VIBRATO_LFO = 2,
+  DERIVED_MOD_WHEEL = 4,
+  DERIVED_PITCH_OFFSETS = 8,
+  DERIVED_CONTROL_RATES = 16,
+  DERIVED_ALL = 0x1f
+};
+
+// LFO rate above which a modulation is considered fast (about 20Hz), and
+// its destination is updated at half the DAC rate rather than a quarter.
+static const uint8_t kFastLfoRate = 176;
 
 struct Patch {
   int8_t vco_dco_range;
@@ -100,6 +117,55 @@ struct Patch {
   uint8_t padding;
 };
 
+// Bits of the mask of DAC channels which have changed since the last DAC
+// update.
+enum DACChannel {
+  DAC_CHANNEL_VCO = 1,
+  DAC_CHANNEL_VCF = 2,
+  DAC_CHANNEL_VCA = 4,
+  DAC_CHANNEL_PW = 8,
+  DAC_CHANNEL_ALL = 0x0f
+};
+
+// A CV computed once every 2^shift DAC state samples, and linearly
+// interpolated in between. The increment is rounded towards zero, so that the
+// ramp never overshoots, and the target is set on the last step.
+struct InterpolatedCv {
+  uint16_t value;
+  uint16_t target;
+  int16_t increment;
+  uint8_t num_steps;
+  
+  inline void Init() {
+    value = 0;
+    target = 0;
+    num_steps = 0;
+  }
+  
+  inline void Start(int16_t new_target, uint8_t shift) {
+    int16_t delta = new_target - static_cast<int16_t>(value);
+    target = new_target;
+    increment = delta >= 0 ? delta >> shift : -(-delta >> shift);
+    num_steps = 1 << shift;
+  }
+  
+  inline uint16_t Next() {
+    if (num_steps) {
+      value = --num_steps ? value + increment : target;
+    }
+    return value;
+  }
+};
+
+struct ScheduledNoteOn {
+  uint8_t note;
+  uint8_t velocity;
+  uint8_t slide;
+  uint8_t accent;
+  bool legato;
+  uint8_t timestamp;
+};
+
 struct DACState {
   uint16_t vco_cv;
   uint16_t pw_cv;
@@ -120,6 +186,16 @@ class Voice {
       uint8_t slide,
       uint8_t accent,
       bool legato);
+  // Plays a note on at a constant latency of kDACStateBufferSize DAC state
+  // samples after the one which was played when the event was received (see
+  // dac_timestamp()), rather than at the next refresh.
+  void ScheduleNoteOn(
+      uint8_t note,
+      uint8_t velocity,
+      uint8_t slide,
+      uint8_t accent,
+      bool legato,
+      uint8_t timestamp);
   void NoteOff(uint8_t note);
   void ControlChange(uint8_t controller, uint8_t value);
   void PitchBend(uint16_t pitch_bend);
@@ -158,6 +234,7 @@ class Voice {
   }
   
   void SavePatch();
+  void LoadPatch();
   void ResetToFactoryDefaults();
   
   void Lock(uint16_t vco_cv, uint16_t pw_cv, uint16_t vcf_cv, uint16_t vca_cv) {
@@ -165,17 +242,45 @@ class Voice {
     dac_state_.pw_cv = pw_cv;
     dac_state_.vcf_cv = vcf_cv;
     dac_state_.vca_cv = vca_cv;
+    dac_state_changes_ = DAC_CHANNEL_ALL;
     locked_ = true;
   }
   
   void ReadDACStateSample() {
     if (!locked_) {
       uint8_t r = dac_state_read_ptr_;
-      dac_state_ = dac_state_buffer_[r];
+      const DACState& next = dac_state_buffer_[r];
+      uint8_t changes = dac_state_changes_;
+      if (next.vco_cv != dac_state_.vco_cv) {
+        changes |= DAC_CHANNEL_VCO;
+      }
+      if (next.vcf_cv != dac_state_.vcf_cv) {
+        changes |= DAC_CHANNEL_VCF;
+      }
+      if (next.vca_cv != dac_state_.vca_cv) {
+        changes |= DAC_CHANNEL_VCA;
+      }
+      if (next.pw_cv != dac_state_.pw_cv) {
+        changes |= DAC_CHANNEL_PW;
+      }
+      dac_state_changes_ = changes;
+      dac_state_ = next;
       dac_state_read_ptr_ = (r + 1) & (kDACStateBufferSize - 1);
+      ++dac_timestamp_;
     }
   }
   
+  // Number of DAC state samples played, modulo 256.
+  inline uint8_t dac_timestamp() const { return dac_timestamp_; }
+  
+  // Returns the mask of DAC channels which have changed since the last call,
+  // so that only those are sent to the DACs.
+  inline uint8_t TakeDACStateChanges() {
+    uint8_t changes = dac_state_changes_;
+    dac_state_changes_ = 0;
+    return changes;
+  }
+  
   inline uint8_t writable() const {
     return (dac_state_read_ptr_ - dac_state_write_ptr_ - 1) & \
         (kDACStateBufferSize - 1);
@@ -196,11 +301,16 @@ class Voice {
   
   void Touch() {
     UpdateEnvelopeParameters();
+    stale_derived_parameters_ = DERIVED_ALL;
   }
   
  private:
+  friend class Benchmark;
+  
   void WriteDACStateSample();
   void UpdateEnvelopeParameters();
+  void UpdateDerivedParameters();
+  void FlushScheduledNoteOn();
    
   Patch patch_;
   Lfo lfo_;
@@ -215,10 +325,14 @@ class Voice {
   
   uint8_t lfo_8_bits_;
   
-  uint16_t vco_cv_;
-  uint16_t pw_cv_;
-  uint16_t vcf_cv_;
-  uint16_t vca_cv_;
+  // The VCO and VCA CVs are computed for every DAC state sample, the PW and
+  // VCF CVs are computed at a rate which depends on how fast they are
+  // modulated.
+  uint8_t control_cycle_;
+  uint8_t pw_rate_shift_;
+  uint8_t vcf_rate_shift_;
+  InterpolatedCv pw_cv_;
+  InterpolatedCv vcf_cv_;
   int16_t dco_pitch_;
   
   int16_t vco_cv_offset_;
@@ -239,10 +353,22 @@ class Voice {
   uint8_t mod_accent_;
   uint8_t volume_;
   
+  uint8_t stale_derived_parameters_;
+  int16_t dco_pitch_offset_;
+  int16_t vco_pitch_offset_;
+  uint8_t mod_wheel_pitch_;
+  uint8_t mod_wheel_growl_;
+  
   DACState dac_state_;
   DACState dac_state_buffer_[kDACStateBufferSize];
   uint8_t dac_state_read_ptr_;
   uint8_t dac_state_write_ptr_;
+  uint8_t dac_state_changes_;
+  uint8_t dac_timestamp_;
+  uint8_t dac_write_timestamp_;
+  
+  bool note_on_scheduled_;
+  ScheduledNoteOn scheduled_note_on_;
   
   DISALLOW_COPY_AND_ASSIGN(Voice);
 };
@@ -21,8 +21,10 @@
 #include "midi/midi.h"
 
 #include "anu/clock.h"
+#include "anu/eeprom_writer.h"
 #include "anu/midi_dispatcher.h"
 #include "anu/parameter.h"
+#include "anu/program_storage.h"
 #include "anu/storage.h"
 #include "anu/system_settings.h"
 
@@ -33,6 +35,8 @@ using namespace avrlib;
 /* <static> */
 SequencerSettings VoiceController::seq_settings_;
 Sequence VoiceController::sequence_;
+SequenceWriter VoiceController::sequence_writer_;
+SequenceReader VoiceController::sequence_reader_;
 Voice VoiceController::voice_;
 
 bool VoiceController::ignore_note_off_messages_;
@@ -61,6 +65,10 @@ uint8_t VoiceController::drum_sequencer_perturbation_[3];
 uint8_t VoiceController::drum_remote_control_current_instrument_;
 
 bool VoiceController::dirty_;
+
+/* static */
+bool VoiceController::sequence_dirty_;
+uint8_t VoiceController::pending_program_;
 /* </static> */
 
 typedef SequencerSettings PROGMEM prog_SequencerSettings;
@@ -91,7 +99,8 @@ static const prog_SequencerSettings init_seq_settings PROGMEM = {
 
 static const prog_Sequence init_sequence PROGMEM = {
   4,
-  { 60, 60, 48, 48 }
+  4,
+  { 0x00, 0x00, 0x14, 0x00 }  // 60, 60, 48, 48.
 };
 
 static const prog_uint8_t* drum_map[3][3] = {
@@ -128,7 +137,9 @@ void VoiceController::Init() {
   STATIC_ASSERT(sizeof(SequencerSettings) == PRM_SEQ_LAST);
   
   storage.Load(&seq_settings_);
-  storage.Load(&sequence_);
+  sequence_dirty_ = false;
+  LoadSequence();
+  sequence_reader_.Init(&sequence_);
   pressed_keys_.Init();
   voice_.Init();
 
@@ -141,6 +152,7 @@ void VoiceController::Init() {
   voice_.set_note(system_settings.reference_note());
   TouchClock();
   dirty_ = false;
+  pending_program_ = 0xff;
 
   RefreshDrumSynthSettings();
   RefreshDrumSynthMixing();
@@ -195,7 +207,11 @@ void VoiceController::SetValue(uint8_t offset, uint8_t value) {
 }
 
 /* static */
-void VoiceController::NoteOn(uint8_t note, uint8_t velocity) {
+void VoiceController::HandleNoteOn(
+    uint8_t note,
+    uint8_t velocity,
+    bool scheduled,
+    uint8_t dac_timestamp) {
   if (velocity == 0) {
     NoteOff(note);
   } else {
@@ -207,7 +223,12 @@ void VoiceController::NoteOn(uint8_t note, uint8_t velocity) {
       pressed_keys_.NoteOn(note, velocity);
       if (seq_settings_.arp_mode == 0) {
         // If the arpeggiator is off, actually trigger the note!
-        voice_.NoteOn(note, velocity, 0, 0, pressed_keys_.size() != 1);
+        bool legato = pressed_keys_.size() != 1;
+        if (scheduled) {
+          voice_.ScheduleNoteOn(note, velocity, 0, 0, legato, dac_timestamp);
+        } else {
+          voice_.NoteOn(note, velocity, 0, 0, legato);
+        }
       } else {
         if (pressed_keys_.size() == 1 && !clock_running_) {
           StartClock();
@@ -216,8 +237,8 @@ void VoiceController::NoteOn(uint8_t note, uint8_t velocity) {
       }
     }
     if (sequencer_recording_) {
-      sequence_.notes[sequence_.num_notes++] = note;
-      if (sequence_.num_notes == 128) {
+      sequence_writer_.AppendNote(note);
+      if (sequence_writer_.full()) {
         sequencer_recording_ = false;
       }
     }
@@ -273,9 +294,7 @@ void VoiceController::ControlChange(uint8_t controller, uint8_t value) {
   if (controller == midi::kModulationWheelMsb &&
       sequencer_recording_ &&
       value > 0x40)  {
-    uint8_t accent_slide_index = sequence_.num_notes >> 3;
-    uint8_t accent_slide_mask = 1 << (sequence_.num_notes & 0x7);
-    sequence_.accents[accent_slide_index] |= accent_slide_mask;
+    sequence_writer_.set_flags(SEQUENCE_FLAG_ACCENT);
   }
   voice_.ControlChange(controller, value);
   switch (controller) {
@@ -298,9 +317,7 @@ void VoiceController::PitchBend(uint16_t pitch_bend) {
   voice_.PitchBend(pitch_bend);
   if (sequencer_recording_ &&
       (pitch_bend > 8192 + 2048 || pitch_bend < 8192 - 2048)) {
-    uint8_t accent_slide_index = sequence_.num_notes >> 3;
-    uint8_t accent_slide_mask = 1 << (sequence_.num_notes & 0x7);
-    sequence_.slides[accent_slide_index] |= accent_slide_mask;
+    sequence_writer_.set_flags(SEQUENCE_FLAG_SLIDE);
   }
 }
 
@@ -365,6 +382,7 @@ void VoiceController::StartSequencer() {
     StopRecording();
   }
   sequencer_note_ = 0;
+  sequence_reader_.Rewind();
   sequencer_running_ = true;
 }
 
@@ -413,20 +431,19 @@ void VoiceController::ClockSequencer() {
     return;
   }
   
-  int16_t note = sequence_.notes[sequencer_note_];
-  if (note == 0xff) {
+  SequenceStep step = sequence_reader_.Next();
+  int16_t note = step.note;
+  if (note == kSequenceRest) {
     // Rest.
     voice_.NoteOff(previous_generated_note_);
     midi_dispatcher.OnInternalNoteOff(previous_generated_note_);
     previous_generated_note_ = 0xff;
-  } else if (note == 0xfe) {
+  } else if (note == kSequenceTie) {
     // Tie: do nothing!
   } else {
-    uint8_t accent_slide_index = sequencer_note_ >> 3;
-    uint8_t accent_slide_mask = 1 << (sequencer_note_ & 0x7);
     note += sequencer_transposition_;
-    bool slid = sequence_.slides[accent_slide_index] & accent_slide_mask;
-    bool accented = sequence_.accents[accent_slide_index] & accent_slide_mask;
+    bool slid = step.flags & SEQUENCE_FLAG_SLIDE;
+    bool accented = step.flags & SEQUENCE_FLAG_ACCENT;
     
     // When the sequencer note is slid, the note emitted on the MIDI out will
     // overlap with the previous note, to allow an external sound module to
@@ -452,6 +469,7 @@ void VoiceController::ClockSequencer() {
   ++sequencer_note_;
   if (sequencer_note_ >= sequence_.num_notes) {
     sequencer_note_ = 0;
+    sequence_reader_.Rewind();
   }
 }
 
@@ -478,9 +496,9 @@ void VoiceController::ClockDrumMachine() {
       }
       
       if (level > threshold) {
-        uint8_t level = 128 + (level >> 1);
-        drum_synth.Trigger(i, level);
-        midi_dispatcher.OnDrumNote(drums_midi_notes[i], level >> 1);
+        uint8_t velocity = 128 + (level >> 1);
+        drum_synth.Trigger(i, velocity);
+        midi_dispatcher.OnDrumNote(drums_midi_notes[i], velocity >> 1);
       }
       override_mask <<= 1;
     }
@@ -613,6 +631,7 @@ void VoiceController::StartRecording() {
   seq_settings_.arp_mode = 0;
   sequencer_recording_ = true;
   memset(&sequence_, 0, sizeof(Sequence));
+  sequence_writer_.Init(&sequence_);
 }
 
 /* static */
@@ -626,22 +645,104 @@ void VoiceController::StopRecording() {
 
 /* static */
 void VoiceController::SaveSequence() {
-  storage.Save(sequence_);
+  sequence_dirty_ = true;
+  SavePendingSequence();
+}
+
+/* static */
+void VoiceController::SavePendingSequence() {
+  // The sequence stays dirty, and is saved at the next attempt, if the EEPROM
+  // writer is full.
+  if (sequence_dirty_ && storage.Save(
+          &sequence_,
+          StorageLayout<Sequence>::eeprom_address(),
+          sequence_.packed_size())) {
+    sequence_dirty_ = false;
+  }
+}
+
+/* static */
+void VoiceController::RewindSequence() {
+  sequence_reader_.Rewind();
+  sequencer_note_ = 0;
+}
+
+/* static */
+void VoiceController::LoadSequence() {
+  uint8_t* address = StorageLayout<Sequence>::eeprom_address();
+  if (ReadSequence(&sequence_, address)) {
+    return;
+  }
+  if (ReadLegacySequence(&sequence_, address)) {
+    // Saved by a previous version of the firmware: it is converted once.
+    SaveSequence();
+  } else {
+    memcpy_P(
+        &sequence_,
+        StorageLayout<Sequence>::init_data(),
+        sizeof(Sequence));
+  }
 }
 
 /* static */
 void VoiceController::SavePatch() {
-  if (dirty_) {
-    storage.Save(seq_settings_);
+  if (dirty_ && storage.Save(seq_settings_)) {
+    dirty_ = false;
   }
   voice_.SavePatch();
-  dirty_ = false;
+}
+
+/* static */
+bool VoiceController::StoreProgram(uint8_t program) {
+  if (program >= kNumPrograms) {
+    return false;
+  }
+  return program_storage.Store(
+      program,
+      *voice_.mutable_patch(),
+      seq_settings_,
+      sequence_);
+}
+
+/* static */
+void VoiceController::RecallProgram(uint8_t program) {
+  if (program >= kNumPrograms) {
+    return;
+  }
+  if (eeprom_writer.busy()) {
+    pending_program_ = program;
+    return;
+  }
+  pending_program_ = 0xff;
+  if (program_storage.empty(program)) {
+    return;
+  }
+  if (!program_storage.Recall(
+          program,
+          voice_.mutable_patch(),
+          &seq_settings_,
+          &sequence_)) {
+    // The program is corrupted: go back to the saved patch and sequence.
+    voice_.LoadPatch();
+    storage.Load(&seq_settings_);
+    LoadSequence();
+  }
+  RewindSequence();
+  Touch();
+}
+
+/* static */
+void VoiceController::RecallPendingProgram() {
+  if (pending_program_ != 0xff && !eeprom_writer.busy()) {
+    RecallProgram(pending_program_);
+  }
 }
 
 /* static */
 void VoiceController::ResetToFactoryDefaults() {
   storage.ResetToFactoryDefaults(&seq_settings_);
-  storage.ResetToFactoryDefaults(&sequence_);
+  memcpy_P(&sequence_, StorageLayout<Sequence>::init_data(), sizeof(Sequence));
+  SaveSequence();
   voice_.ResetToFactoryDefaults();
 }
 
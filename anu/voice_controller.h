@@ -22,6 +22,7 @@
 #include "anu/envelope.h"
 #include "anu/lfo.h"
 #include "anu/note_stack.h"
+#include "anu/sequence.h"
 #include "anu/voice.h"
 
 namespace anu {
@@ -90,21 +91,21 @@ struct SequencerSettings {
         (drums_density[1] > 1) || \
         (drums_density[2] > 1) || drums_override;
   }
-};
-
-struct Sequence {
-  uint8_t num_notes;
-  uint8_t notes[128];
-  uint8_t accents[16];
-  uint8_t slides[16];
-};
+} __attribute__((packed));
 
 class VoiceController {
  public:
   VoiceController() { }
   ~VoiceController() { }
   static void Init();
-  static void NoteOn(uint8_t note, uint8_t velocity);
+  static void NoteOn(uint8_t note, uint8_t velocity) {
+    HandleNoteOn(note, velocity, false, 0);
+  }
+  // Note on received from MIDI, with the DAC timestamp of its reception (see
+  // Voice::ScheduleNoteOn).
+  static void NoteOn(uint8_t note, uint8_t velocity, uint8_t dac_timestamp) {
+    HandleNoteOn(note, velocity, true, dac_timestamp);
+  }
   static void NoteOff(uint8_t note);
   static void ControlChange(uint8_t controller, uint8_t value);
   static void PitchBend(uint16_t pitch_bend);
@@ -126,15 +127,15 @@ class VoiceController {
   }
   
   static inline void InsertRest() {
-    sequence_.notes[sequence_.num_notes++] = 0xff;
-    if (sequence_.num_notes == 128) {
+    sequence_writer_.AppendRest();
+    if (sequence_writer_.full()) {
       StopRecording();
     }
   };
   
   static inline void InsertTie() {
-    sequence_.notes[sequence_.num_notes++] = 0xfe;
-    if (sequence_.num_notes == 128) {
+    sequence_writer_.AppendTie();
+    if (sequence_writer_.full()) {
       StopRecording();
     }
   };
@@ -151,6 +152,11 @@ class VoiceController {
   
   static void StopRecording();
   static void SaveSequence();
+  // Saves the sequence which could not be saved because the EEPROM writer was
+  // full. Called by the main loop.
+  static void SavePendingSequence();
+  // Plays the sequence from its first step, after it has been replaced.
+  static void RewindSequence();
   static void RemoteControlDrumSequencer(uint8_t note);
   static void StartRecording();
   
@@ -194,6 +200,16 @@ class VoiceController {
   }
   static void SavePatch();
   static void ResetToFactoryDefaults();
+  
+  // Programs stored in the slots of the EEPROM (see program_storage.h).
+  static bool StoreProgram(uint8_t program);
+  // The recall is deferred while the EEPROM is being written: the program
+  // being stored would otherwise be overwritten by the recalled one, and the
+  // writes could corrupt the reads.
+  static void RecallProgram(uint8_t program);
+  // Recalls the deferred program, once the EEPROM writer is idle. Called by
+  // the main loop.
+  static void RecallPendingProgram();
   static void ReleaseAllHeldNotes();
   
   static void Touch() {
@@ -204,6 +220,12 @@ class VoiceController {
   static void TouchClock();
   
  private:
+  static void LoadSequence();
+  static void HandleNoteOn(
+      uint8_t note,
+      uint8_t velocity,
+      bool scheduled,
+      uint8_t dac_timestamp);
   static void ResetArpeggiatorPattern();
 
   static void StartClock();
@@ -231,6 +253,8 @@ class VoiceController {
   
   static SequencerSettings seq_settings_;
   static Sequence sequence_;
+  static SequenceWriter sequence_writer_;
+  static SequenceReader sequence_reader_;
   static Voice voice_;
   
   static bool ignore_note_off_messages_;
@@ -260,6 +284,10 @@ class VoiceController {
   static uint8_t drum_remote_control_current_instrument_;
   
   static bool dirty_;
+  static bool sequence_dirty_;
+  
+  // Program to recall once the EEPROM writer is idle, 0xff if none.
+  static uint8_t pending_program_;
   
   DISALLOW_COPY_AND_ASSIGN(VoiceController);
 };